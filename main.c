@@ -709,7 +709,7 @@ int main(int argv, char **argc) {
                    .sectors = FAKE_PROM_SIZE / FAKE_PROM_SECTOR_SIZE,
                    .sectorSize = FAKE_PROM_SECTOR_SIZE,
                    .tableSectors = (FAKE_PROM_SIZE / FAKE_PROM_SECTOR_SIZE) *
-                                   UFAT_TABLE_COUNT / FAKE_PROM_SECTOR_SIZE,
+                                   sizeof(ufat_sector_t) / FAKE_PROM_SECTOR_SIZE,
                    .write_block_device = write_block_page,
                    .read_block_device = read_block_device};
 
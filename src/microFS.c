@@ -31,8 +31,8 @@
 #include <time.h>
 
 #define UFAT_FILE_NOT_FOUND (-1)
-#define UFAT_INVALID_SECTOR (0xFFFF)
-#define UFAT_EOF (0x0FFF)
+#define UFAT_INVALID_SECTOR ((ufat_link_t)~0u)
+#define UFAT_EOF UFAT_MAX_SECTORS
 
 #define UFAT_TABLE_GOOD 0
 #define UFAT_TABLE_OLD 1
@@ -40,80 +40,700 @@
 
 #define UFAT_FLAG_READ 1
 #define UFAT_FLAG_WRITE 2
-#define UFAT_FLAG_ZERO_COPY 4 // Not implemented for writes
+#define UFAT_FLAG_ZERO_COPY 4 // Driver transfers use the caller buffer
 #define UFAT_FILE_CRC_CHECK 8
+#define UFAT_FLAG_APPEND 16
+#define UFAT_FLAG_UPDATE 32
 
 #define UFAT_TABLE_SIZE(sectors) (sizeof(ufat_sector_t) * sectors)
-#define UFAT_FIRST_SECTOR(tableSectors) (tableSectors * UFAT_TABLE_COUNT)
+#define UFAT_COPY_SIZE(fs) ((fs)->sectorSize * (fs)->tableSectors)
+/* fs->buff holds a table copy, or a cluster with a paged table */
+#define UFAT_BUFF_SIZE(fs) ((fs)->fat ? UFAT_COPY_SIZE(fs) : (fs)->clusterSize)
+#define UFAT_NO_PAGE 0xFFFFFFFF
+
+/* Bit 15 set, never a legacy reserved entry */
+#define UFAT_TABLE_MAGIC 0xF5A7
+#define UFAT_FEATURE_ALL                                                       \
+  (UFAT_FEATURE_DIR_TABLE | UFAT_FEATURE_SECTOR_CRC | UFAT_FEATURE_PING_PONG | \
+   UFAT_FEATURE_LARGE_FILES)
+/* Name table could not hold every file, rebuilt by the next mount */
+#define UFAT_STATE_DIR_OVERFLOW (1 << 0)
+/* Written by ufat_unmount(), mount skips recovery. The state field is in
+ * the reserved entries of legacy volumes too */
+#define UFAT_STATE_CLEAN (1 << 1)
+#define UFAT_DIR_OFFSET(sectors) ((UFAT_TABLE_SIZE(sectors) + 3) & ~3UL)
+#define UFAT_ALIGN4(x) (((x) + 3) & ~3UL)
+
+#ifndef UFAT_EXTENT_MIN
+#define UFAT_EXTENT_MIN 2
+#endif
+#ifndef UFAT_EXTENT_MAX
+#define UFAT_EXTENT_MAX 32
+#endif
+
+#ifndef UFAT_CTZ
+#if defined(__GNUC__)
+#define UFAT_CTZ __builtin_ctz
+#else
+static uint32_t ctz32(uint32_t x) {
+  uint32_t n = 0;
+  while (!(x & 1)) {
+    x >>= 1;
+    n++;
+  }
+  return n;
+}
+#define UFAT_CTZ ctz32
+#endif
+#endif
 
 #ifndef UFAT_CRC
-/* crc routines written by unknown public source */
-static uint32_t crc32_table[256];
-void init_crc32(void);
-static uint32_t crc32(void *buf, int len, uint32_t Seed);
+/* crc routines written by unknown public source. MSB first CRC-32 without
+ * the final complement, every UFAT_CRC_KERNEL gives the same result and
+ * trades table ROM for speed */
+#define UFAT_CRC_NIBBLE 1  /* 64 B table, 2 lookups per byte */
+#define UFAT_CRC_BYTE 2    /* 1 KB table */
+#define UFAT_CRC_SLICE8 3  /* 8 KB table, 8 bytes per step */
+#define UFAT_CRC_SLICE16 4 /* 16 KB table, 16 bytes per step */
+#ifndef UFAT_CRC_KERNEL
+#define UFAT_CRC_KERNEL UFAT_CRC_BYTE
+#endif
 
-#define CRC32_POLY 0x04c11db7 /* AUTODIN II, Ethernet, & FDDI 0x04C11DB7 */
-#define UFAT_CRC crc32
+#ifdef TEST_DEV
+/* Every kernel is built for the CRC tests and benchmark */
+#define UFAT_CRC_ALL
+#define UFAT_CRC_FN
+#else
+#define UFAT_CRC_FN static
+#endif
 
-uint32_t crc32(void *buf, int len, uint32_t Seed) {
-  UFAT_TRACE(("crc32:0x%p|%i|0x%X\r\n", buf, len, Seed));
+/* Tables are built by the preprocessor so they are const, ROM resident and
+ * need no init. Entry i is the xor of x^(32+8k+b) mod P over the set bits b of
+ * i, with k the number of zero bytes that follow; CRC32_Xk lists them for
+ * b = 0..7. P is 0x04C11DB7 (AUTODIN II, Ethernet, & FDDI)
+ */
+#define CRC32_X0                                                               \
+  0x04C11DB7, 0x09823B6E, 0x130476DC, 0x2608EDB8,                              \
+      0x4C11DB70, 0x9823B6E0, 0x34867077, 0x690CE0EE
+#define CRC32_X1                                                               \
+  0xD219C1DC, 0xA0F29E0F, 0x452421A9, 0x8A484352,                              \
+      0x10519B13, 0x20A33626, 0x41466C4C, 0x828CD898
+#define CRC32_X2                                                               \
+  0x01D8AC87, 0x03B1590E, 0x0762B21C, 0x0EC56438,                              \
+      0x1D8AC870, 0x3B1590E0, 0x762B21C0, 0xEC564380
+#define CRC32_X3                                                               \
+  0xDC6D9AB7, 0xBC1A28D9, 0x7CF54C05, 0xF9EA980A,                              \
+      0xF7142DA3, 0xEAE946F1, 0xD1139055, 0xA6E63D1D
+#define CRC32_X4                                                               \
+  0x490D678D, 0x921ACF1A, 0x20F48383, 0x41E90706,                              \
+      0x83D20E0C, 0x036501AF, 0x06CA035E, 0x0D9406BC
+#define CRC32_X5                                                               \
+  0x1B280D78, 0x36501AF0, 0x6CA035E0, 0xD9406BC0,                              \
+      0xB641CA37, 0x684289D9, 0xD08513B2, 0xA5CB3AD3
+#define CRC32_X6                                                               \
+  0x4F576811, 0x9EAED022, 0x399CBDF3, 0x73397BE6,                              \
+      0xE672F7CC, 0xC824F22F, 0x9488F9E9, 0x2DD0EE65
+#define CRC32_X7                                                               \
+  0x5BA1DCCA, 0xB743B994, 0x6A466E9F, 0xD48CDD3E,                              \
+      0xADD8A7CB, 0x5F705221, 0xBEE0A442, 0x79005533
+#define CRC32_X8                                                               \
+  0xF200AA66, 0xE0C0497B, 0xC5418F41, 0x8E420335,                              \
+      0x18451BDD, 0x308A37BA, 0x61146F74, 0xC228DEE8
+#define CRC32_X9                                                               \
+  0x8090A067, 0x05E05D79, 0x0BC0BAF2, 0x178175E4,                              \
+      0x2F02EBC8, 0x5E05D790, 0xBC0BAF20, 0x7CD643F7
+#define CRC32_X10                                                              \
+  0xF9AC87EE, 0xF798126B, 0xEBF13961, 0xD3236F75,                              \
+      0xA287C35D, 0x41CE9B0D, 0x839D361A, 0x03FB7183
+#define CRC32_X11                                                              \
+  0x07F6E306, 0x0FEDC60C, 0x1FDB8C18, 0x3FB71830,                              \
+      0x7F6E3060, 0xFEDC60C0, 0xF979DC37, 0xF632A5D9
+#define CRC32_X12                                                              \
+  0xE8A45605, 0xD589B1BD, 0xAFD27ECD, 0x5B65E02D,                              \
+      0xB6CBC05A, 0x69569D03, 0xD2AD3A06, 0xA19B69BB
+#define CRC32_X13                                                              \
+  0x47F7CEC1, 0x8FEF9D82, 0x1B1E26B3, 0x363C4D66,                              \
+      0x6C789ACC, 0xD8F13598, 0xB5237687, 0x6E87F0B9
+#define CRC32_X14                                                              \
+  0xDD0FE172, 0xBEDEDF53, 0x797CA311, 0xF2F94622,                              \
+      0xE13391F3, 0xC6A63E51, 0x898D6115, 0x17DBDF9D
+#define CRC32_X15                                                              \
+  0x2FB7BF3A, 0x5F6F7E74, 0xBEDEFCE8, 0x797CE467,                              \
+      0xF2F9C8CE, 0xE1328C2B, 0xC6A405E1, 0x89891675
+
+#define CRC32_E(i, x0, x1, x2, x3, x4, x5, x6, x7)                              \
+  (((i)&1 ? (x0) : 0) ^ ((i)&2 ? (x1) : 0) ^ ((i)&4 ? (x2) : 0) ^               \
+   ((i)&8 ? (x3) : 0) ^ ((i)&16 ? (x4) : 0) ^ ((i)&32 ? (x5) : 0) ^             \
+   ((i)&64 ? (x6) : 0) ^ ((i)&128 ? (x7) : 0))
+/* Parenthesised so compilers that pass __VA_ARGS__ as one argument split it */
+#define CRC32_ENTRY(args) CRC32_E args
+#define CRC32_E4(i, ...)                                                       \
+  CRC32_ENTRY((i, __VA_ARGS__)), CRC32_ENTRY(((i) + 1, __VA_ARGS__)),          \
+      CRC32_ENTRY(((i) + 2, __VA_ARGS__)), CRC32_ENTRY(((i) + 3, __VA_ARGS__))
+#define CRC32_E16(i, ...)                                                      \
+  CRC32_E4(i, __VA_ARGS__), CRC32_E4((i) + 4, __VA_ARGS__),                    \
+      CRC32_E4((i) + 8, __VA_ARGS__), CRC32_E4((i) + 12, __VA_ARGS__)
+#define CRC32_E64(i, ...)                                                      \
+  CRC32_E16(i, __VA_ARGS__), CRC32_E16((i) + 16, __VA_ARGS__),                 \
+      CRC32_E16((i) + 32, __VA_ARGS__), CRC32_E16((i) + 48, __VA_ARGS__)
+#define CRC32_ROW(...)                                                         \
+  {                                                                            \
+    CRC32_E64(0, __VA_ARGS__), CRC32_E64(64, __VA_ARGS__),                     \
+        CRC32_E64(128, __VA_ARGS__), CRC32_E64(192, __VA_ARGS__)               \
+  }
+
+#if UFAT_CRC_KERNEL == UFAT_CRC_NIBBLE || defined(UFAT_CRC_ALL)
+static const uint32_t crc32_nibble_table[16] = {CRC32_E16(0, CRC32_X0)};
+UFAT_CRC_FN uint32_t crc32_nibble(void *buf, int len, uint32_t Seed);
+
+uint32_t crc32_nibble(void *buf, int len, uint32_t Seed) {
   unsigned char *p;
   uint32_t crc = Seed;
-  if (!crc32_table[1]) { /* if not already done, */
-    init_crc32();        /* build table */
+  for (p = buf; len > 0; ++p, --len) {
+    crc = (crc << 4) ^ crc32_nibble_table[(crc >> 28) ^ (*p >> 4)];
+    crc = (crc << 4) ^ crc32_nibble_table[(crc >> 28) ^ (*p & 0xF)];
   }
+  return crc;
+}
+#endif
+
+#if UFAT_CRC_KERNEL == UFAT_CRC_BYTE || defined(UFAT_CRC_ALL)
+static const uint32_t crc32_table[256] = CRC32_ROW(CRC32_X0);
+UFAT_CRC_FN uint32_t crc32_byte(void *buf, int len, uint32_t Seed);
+
+uint32_t crc32_byte(void *buf, int len, uint32_t Seed) {
+  UFAT_TRACE(("crc32:0x%p|%i|0x%X\r\n", buf, len, Seed));
+  unsigned char *p;
+  uint32_t crc = Seed;
   for (p = buf; len > 0; ++p, --len) {
     crc = (crc << 8) ^ crc32_table[(crc >> 24) ^ *p];
   }
   return crc; /* transmit complement, per CRC-32 spec */
 }
+#endif
+
+#if UFAT_CRC_KERNEL == UFAT_CRC_SLICE16 || defined(UFAT_CRC_ALL)
+#define CRC32_SLICES 16
+#elif UFAT_CRC_KERNEL == UFAT_CRC_SLICE8
+#define CRC32_SLICES 8
+#endif
+
+#ifdef CRC32_SLICES
+/* Row k is the CRC of a byte followed by k zero bytes */
+static const uint32_t crc32_slice_table[CRC32_SLICES][256] = {
+    CRC32_ROW(CRC32_X0),  CRC32_ROW(CRC32_X1),  CRC32_ROW(CRC32_X2),
+    CRC32_ROW(CRC32_X3),  CRC32_ROW(CRC32_X4),  CRC32_ROW(CRC32_X5),
+    CRC32_ROW(CRC32_X6),  CRC32_ROW(CRC32_X7),
+#if CRC32_SLICES == 16
+    CRC32_ROW(CRC32_X8),  CRC32_ROW(CRC32_X9),  CRC32_ROW(CRC32_X10),
+    CRC32_ROW(CRC32_X11), CRC32_ROW(CRC32_X12), CRC32_ROW(CRC32_X13),
+    CRC32_ROW(CRC32_X14), CRC32_ROW(CRC32_X15),
+#endif
+};
+
+/* Register xor the first 4 bytes, big endian so any alignment works */
+#define CRC32_WORD(p, crc)                                                     \
+  ((crc) ^ (((uint32_t)(p)[0] << 24) | ((uint32_t)(p)[1] << 16) |              \
+            ((uint32_t)(p)[2] << 8) | (p)[3]))
+
+#define CRC32_SLICE_WORD(w, k)                                                 \
+  (crc32_slice_table[(k) + 3][(w) >> 24] ^                                     \
+   crc32_slice_table[(k) + 2][((w) >> 16) & 0xFF] ^                            \
+   crc32_slice_table[(k) + 1][((w) >> 8) & 0xFF] ^                             \
+   crc32_slice_table[(k)][(w)&0xFF])
+
+#define CRC32_SLICE_BYTES(p, k)                                                \
+  (crc32_slice_table[(k) + 3][(p)[0]] ^ crc32_slice_table[(k) + 2][(p)[1]] ^   \
+   crc32_slice_table[(k) + 1][(p)[2]] ^ crc32_slice_table[(k)][(p)[3]])
+
+static uint32_t crc32_tail(unsigned char *p, int len, uint32_t crc) {
+  for (; len > 0; ++p, --len) {
+    crc = (crc << 8) ^ crc32_slice_table[0][(crc >> 24) ^ *p];
+  }
+  return crc;
+}
+#endif
+
+#if UFAT_CRC_KERNEL == UFAT_CRC_SLICE8 || defined(UFAT_CRC_ALL)
+UFAT_CRC_FN uint32_t crc32_slice8(void *buf, int len, uint32_t Seed);
+
+uint32_t crc32_slice8(void *buf, int len, uint32_t Seed) {
+  unsigned char *p = buf;
+  uint32_t crc = Seed;
+  uint32_t w;
+  for (; len >= 8; p += 8, len -= 8) {
+    w = CRC32_WORD(p, crc);
+    crc = CRC32_SLICE_WORD(w, 4) ^ CRC32_SLICE_BYTES(p + 4, 0);
+  }
+  return crc32_tail(p, len, crc);
+}
+#endif
+
+#if UFAT_CRC_KERNEL == UFAT_CRC_SLICE16 || defined(UFAT_CRC_ALL)
+UFAT_CRC_FN uint32_t crc32_slice16(void *buf, int len, uint32_t Seed);
+
+uint32_t crc32_slice16(void *buf, int len, uint32_t Seed) {
+  unsigned char *p = buf;
+  uint32_t crc = Seed;
+  uint32_t w;
+  for (; len >= 16; p += 16, len -= 16) {
+    w = CRC32_WORD(p, crc);
+    crc = CRC32_SLICE_WORD(w, 12) ^ CRC32_SLICE_BYTES(p + 4, 8) ^
+          CRC32_SLICE_BYTES(p + 8, 4) ^ CRC32_SLICE_BYTES(p + 12, 0);
+  }
+  return crc32_tail(p, len, crc);
+}
+#endif
+
+#if UFAT_CRC_KERNEL == UFAT_CRC_NIBBLE
+#define CRC32_TABLE_FN crc32_nibble
+#elif UFAT_CRC_KERNEL == UFAT_CRC_BYTE
+#define CRC32_TABLE_FN crc32_byte
+#elif UFAT_CRC_KERNEL == UFAT_CRC_SLICE8
+#define CRC32_TABLE_FN crc32_slice8
+#elif UFAT_CRC_KERNEL == UFAT_CRC_SLICE16
+#define CRC32_TABLE_FN crc32_slice16
+#else
+#error "Unknown UFAT_CRC_KERNEL"
+#endif
+
+/* Carry-less multiply folding on x86-64 hosts, picked at run time by CPUID
+ * with the table kernel as fallback. UFAT_CRC_NO_CLMUL leaves it out */
+#if !defined(UFAT_CRC_NO_CLMUL) && (defined(__x86_64__) || defined(_M_X64)) && \
+    (defined(__GNUC__) || defined(_MSC_VER))
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define CRC32_CLMUL_TARGET
+#else
+#include <cpuid.h>
+#include <immintrin.h>
+#define CRC32_CLMUL_TARGET __attribute__((target("pclmul,ssse3")))
+#endif
+
+/* x^n mod P, moving the high and low 64 bits of a lane n bits forward */
+#define CRC32_K128 0xE8A45605ULL
+#define CRC32_K192 0xC5B9CD4CULL
+#define CRC32_K512 0xE6228B11ULL
+#define CRC32_K576 0x8833794CULL
+/* Shorter buffers stay on the table kernel */
+#define CRC32_CLMUL_MIN 64
+
+UFAT_CRC_FN int crc32_clmul_supported(void);
+UFAT_CRC_FN uint32_t crc32_clmul(void *buf, int len, uint32_t Seed);
+
+/* Asked once per mount or format, the answer is kept in the volume */
+int crc32_clmul_supported(void) {
+#if defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 1);
+  return (info[2] & (1 << 1)) && (info[2] & (1 << 9));
+#else
+  unsigned int a, b, c, d;
+  return __get_cpuid(1, &a, &b, &c, &d) && (c & bit_PCLMUL) &&
+         (c & bit_SSSE3);
+#endif
+}
 
-void init_crc32(void) {
-  int i, j;
-  uint32_t c;
-  for (i = 0; i < 256; ++i) {
-    for (c = i << 24, j = 8; j > 0; --j) {
-      c = c & 0x80000000 ? (c << 1) ^ CRC32_POLY : (c << 1);
+/* Bytes are reversed so bit n of a lane is the x^n coefficient */
+#define CRC32_LOAD(p, swap)                                                    \
+  _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p)), swap)
+
+#define CRC32_FOLD(x, k)                                                       \
+  _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x11),                              \
+                _mm_clmulepi64_si128(x, k, 0x00))
+
+CRC32_CLMUL_TARGET uint32_t crc32_clmul(void *buf, int len, uint32_t Seed) {
+  unsigned char *p = buf;
+  uint8_t block[16];
+  const __m128i swap =
+      _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  const __m128i k128 = _mm_set_epi64x(CRC32_K192, CRC32_K128);
+  const __m128i k512 = _mm_set_epi64x(CRC32_K576, CRC32_K512);
+  __m128i x0, x1, x2, x3;
+  if (len < 32) {
+    return CRC32_TABLE_FN(buf, len, Seed);
+  }
+  /* The seed is the same as xor into the first 4 bytes */
+  x0 = _mm_xor_si128(CRC32_LOAD(p, swap), _mm_set_epi32((int)Seed, 0, 0, 0));
+  p += 16;
+  len -= 16;
+  if (len >= 64) {
+    x1 = CRC32_LOAD(p, swap);
+    x2 = CRC32_LOAD(p + 16, swap);
+    x3 = CRC32_LOAD(p + 32, swap);
+    for (p += 48, len -= 48; len >= 64; p += 64, len -= 64) {
+      x0 = _mm_xor_si128(CRC32_FOLD(x0, k512), CRC32_LOAD(p, swap));
+      x1 = _mm_xor_si128(CRC32_FOLD(x1, k512), CRC32_LOAD(p + 16, swap));
+      x2 = _mm_xor_si128(CRC32_FOLD(x2, k512), CRC32_LOAD(p + 32, swap));
+      x3 = _mm_xor_si128(CRC32_FOLD(x3, k512), CRC32_LOAD(p + 48, swap));
     }
-    crc32_table[i] = c;
+    x0 = _mm_xor_si128(CRC32_FOLD(x0, k128), x1);
+    x0 = _mm_xor_si128(CRC32_FOLD(x0, k128), x2);
+    x0 = _mm_xor_si128(CRC32_FOLD(x0, k128), x3);
   }
+  for (; len >= 16; p += 16, len -= 16) {
+    x0 = _mm_xor_si128(CRC32_FOLD(x0, k128), CRC32_LOAD(p, swap));
+  }
+  /* Last lane and the tail through the table kernel */
+  _mm_storeu_si128((__m128i *)block, _mm_shuffle_epi8(x0, swap));
+  return CRC32_TABLE_FN(p, len, CRC32_TABLE_FN(block, 16, 0));
+}
+
+static uint32_t crc32_dispatch(uint32_t fold, void *buf, int len,
+                               uint32_t Seed) {
+  if (len >= CRC32_CLMUL_MIN && fold) {
+    return crc32_clmul(buf, len, Seed);
+  }
+  return CRC32_TABLE_FN(buf, len, Seed);
 }
 
+#define UFAT_CRC CRC32_TABLE_FN
+#define UFAT_FS_CRC(fs, buf, len, Seed)                                        \
+  crc32_dispatch((fs)->crcFold, buf, len, Seed)
+#define UFAT_CRC_FOLD() crc32_clmul_supported()
+#else
+#define UFAT_CRC CRC32_TABLE_FN
 #endif
 
+#endif
+
+#ifndef UFAT_FS_CRC
+/* UFAT_CRC for a volume, which may pick a kernel found at mount */
+#define UFAT_FS_CRC(fs, buf, len, Seed) ((void)(fs), UFAT_CRC(buf, len, Seed))
+#endif
+#ifndef UFAT_CRC_FOLD
+#define UFAT_CRC_FOLD() 0
+#endif
+
+#ifndef UFAT_CRC_POLY
+/* Polynomial of UFAT_CRC, used to move CRCs across zero bytes */
+#define UFAT_CRC_POLY 0x04C11DB7
+#endif
+
+/* a * b mod P, MSB first */
+static uint32_t crcMultiply(uint32_t a, uint32_t b) {
+  uint32_t i, r = 0;
+  for (i = 0; i < 32; i++) {
+    r = r & 0x80000000 ? (r << 1) ^ UFAT_CRC_POLY : r << 1;
+    if (b & (0x80000000UL >> i)) {
+      r ^= a;
+    }
+  }
+  return r;
+}
+
+/* crc * x^(8 * len) mod P, the register after len zero bytes */
+static uint32_t crcShift(uint32_t crc, uint32_t len) {
+  uint32_t power = 1;
+  uint32_t base = 1UL << 8;
+  for (; len; len >>= 1) {
+    if (len & 1) {
+      power = crcMultiply(power, base);
+    }
+    base = crcMultiply(base, base);
+  }
+  return crcMultiply(crc, power);
+}
+
+/* CRC of A followed by B from their separate 0xFFFFFFFF seeded CRCs */
+uint32_t ufat_crc32_combine(uint32_t crcA, uint32_t crcB, uint32_t lenB) {
+  return crcShift(crcA ^ 0xFFFFFFFF, lenB) ^ crcB;
+}
+
+/* Updates crc for len bytes replaced in place, tailLen bytes before the end
+ * of the data it covers */
+uint32_t ufat_crc32_patch(uint32_t crc, const void *oldData,
+                          const void *newData, uint32_t len,
+                          uint32_t tailLen) {
+  uint32_t delta = UFAT_CRC((void *)oldData, len, 0) ^
+                   UFAT_CRC((void *)newData, len, 0);
+  return crc ^ crcShift(delta, tailLen);
+}
+
+/* Bytes of entries and name table, 0 for an unknown layout */
+static uint32_t tablePayload(ufat_fs_t *fs, ufat_table_header_t *header) {
+  uint32_t len = UFAT_TABLE_SIZE(fs->clusters);
+  if (header->magic != UFAT_TABLE_MAGIC) {
+    return len;
+  }
+  if (header->features & ~UFAT_FEATURE_ALL) {
+    return 0;
+  }
+  if (header->features & UFAT_FEATURE_DIR_TABLE) {
+    len = UFAT_DIR_OFFSET(fs->clusters) +
+          (sizeof(ufat_dir_slot_t) * header->dirSlots);
+  }
+  return len;
+}
+
+static int sectorCrcs(ufat_table_header_t *header) {
+  return header->magic == UFAT_TABLE_MAGIC &&
+         (header->features & UFAT_FEATURE_SECTOR_CRC);
+}
+
+/* With UFAT_FEATURE_SECTOR_CRC a CRC per table sector of payload follows
+ * the payload, and tableCrc covers only those CRCs */
+static uint32_t tableLength(ufat_fs_t *fs, ufat_table_header_t *header) {
+  uint32_t len = tablePayload(fs, header);
+  if (len && sectorCrcs(header)) {
+    len = UFAT_ALIGN4(len) +
+          (sizeof(uint32_t) * ((len + fs->sectorSize - 1) / fs->sectorSize));
+  }
+  return len;
+}
+
+static uint32_t *sectorCrcTable(ufat_fs_t *fs, ufat_table_t *fat_table,
+                                uint32_t *count) {
+  uint32_t payload = tablePayload(fs, &fat_table->header);
+  *count = (payload + fs->sectorSize - 1) / fs->sectorSize;
+  return (uint32_t *)&((uint8_t *)fat_table)[UFAT_ALIGN4(payload)];
+}
+
+/* data holds table sector sector */
+static uint32_t sectorCRC(ufat_fs_t *fs, uint32_t payload, const uint8_t *data,
+                          uint32_t sector) {
+  uint32_t start = sector * fs->sectorSize;
+  uint32_t end = start + fs->sectorSize;
+  uint32_t from = start < sizeof(uint32_t) ? sizeof(uint32_t) : start;
+  end = end > payload ? payload : end;
+  return UFAT_FS_CRC(fs, (void *)&data[from - start], end - from,
+                     0xFFFFFFFF);
+}
+
 static uint32_t calcTableCRC(ufat_fs_t *fs, ufat_table_t *fat_table) {
+  uint32_t i, count;
+  uint32_t *crcs;
+  uint32_t len = tableLength(fs, &fat_table->header);
+  uint32_t payload = tablePayload(fs, &fat_table->header);
+  if (len == 0 || len > UFAT_COPY_SIZE(fs)) {
+    /* Unknown layout, never matches */
+    return ~fat_table->tableCrc;
+  }
+  if (sectorCrcs(&fat_table->header)) {
+    crcs = sectorCrcTable(fs, fat_table, &count);
+    for (i = 0; i < count; i++) {
+      if (sectorCRC(fs, payload,
+                    &((uint8_t *)fat_table)[i * fs->sectorSize],
+                    i) != crcs[i]) {
+        return ~fat_table->tableCrc;
+      }
+    }
+    return UFAT_FS_CRC(fs, crcs, sizeof(uint32_t) * count, 0xFFFFFFFF);
+  }
   /* Offset CRC sizeof(uint32_t) */
-  return UFAT_CRC(&((uint8_t *)fat_table)[sizeof(uint32_t)],
-                  UFAT_TABLE_SIZE(fs->sectors) - sizeof(uint32_t), 0xFFFFFFFF);
+  return UFAT_FS_CRC(fs, &((uint8_t *)fat_table)[sizeof(uint32_t)],
+                     len - sizeof(uint32_t), 0xFFFFFFFF);
+}
+
+static void tableDirty(ufat_fs_t *fs, uint32_t offset, uint32_t len) {
+  uint32_t i = (offset / fs->sectorSize) >> fs->dirtyShift;
+  uint32_t hi = ((offset + len - 1) / fs->sectorSize) >> fs->dirtyShift;
+  for (; i <= hi; i++) {
+    fs->dirty[i / 32] |= 1UL << (i % 32);
+  }
+}
+
+static int sectorBit(ufat_fs_t *fs, const uint32_t *map, uint32_t sector) {
+  sector >>= fs->dirtyShift;
+  return (map[sector / 32] >> (sector % 32)) & 1;
 }
 
-static int32_t scanTable(ufat_fs_t *fs, ufat_table_t *fat) {
+#define sectorDirty(fs, sector) sectorBit(fs, (fs)->dirty, sector)
+
+static void tableClean(ufat_fs_t *fs) {
+  memset(fs->dirty, 0, sizeof(fs->dirty));
+  memset(fs->spilled, 0, sizeof(fs->spilled));
+  fs->pageDirty = 0;
+  for (fs->dirtyShift = 0;
+       ((fs->tableSectors - 1) >> fs->dirtyShift) >= 32 * UFAT_DIRTY_WORDS;
+       fs->dirtyShift++) {
+  }
+}
+
+static int ioWait(ufat_fs_t *fs);
+
+static uint8_t *pageData(ufat_fs_t *fs, uint32_t slot) {
+  return &fs->pages[slot * fs->sectorSize];
+}
+
+/* One table sector of a copy, after the transfer in flight */
+static int pageIo(ufat_fs_t *fs, int write, uint32_t tableIndex, uint32_t page,
+                  uint8_t *data) {
+  uint32_t address = fs->addressStart + (UFAT_COPY_SIZE(fs) * tableIndex) +
+                     (page * fs->sectorSize);
+  if (ioWait(fs) ||
+      (write ? fs->write_block_device(address, data, fs->sectorSize)
+             : fs->read_block_device(address, data, fs->sectorSize))) {
+    fs->lastError = UFAT_ERR_IO;
+    UFAT_TRACE(("pageIo:UFAT_ERR_IO\r\n"));
+    return UFAT_ERR_IO;
+  }
+  return UFAT_OK;
+}
+
+static void pageReset(ufat_fs_t *fs) {
+  uint32_t i;
+  for (i = 0; i < UFAT_PAGE_SLOTS; i++) {
+    fs->pageTag[i] = UFAT_NO_PAGE;
+  }
+  fs->pageDirty = 0;
+  fs->pageLast = 0;
+}
+
+static int32_t pageFind(ufat_fs_t *fs, uint32_t page) {
+  uint32_t i;
+  if (fs->pageTag[fs->pageLast] == page) {
+    return fs->pageLast;
+  }
+  for (i = 0; i < fs->pageSlots; i++) {
+    if (fs->pageTag[i] == page) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Copy holding the newest version of a table sector not in a slot. After an
+ * IO error an eviction may have torn, so only the committed copy is read */
+static uint32_t pageSource(ufat_fs_t *fs, uint32_t page) {
+  if (fs->lastError == UFAT_ERR_IO) {
+    return fs->tableIndex;
+  }
+  return fs->tableIndex ^ sectorBit(fs, fs->spilled, page);
+}
+
+/* A changed sector is written to the other copy, which the commit rewrites
+ * and which does not validate until then. The first from a dirty group
+ * takes the whole group along, moving the sectors not in a slot through
+ * this one, so later loads of the group read the other copy */
+static void pageEvict(ufat_fs_t *fs, uint32_t slot) {
+  uint32_t victim = fs->pageTag[slot];
+  uint32_t other = fs->tableIndex ^ 1;
+  uint32_t page, group, end;
+  int32_t held;
+  fs->pageTag[slot] = UFAT_NO_PAGE;
+  if (!(fs->pageDirty & (1UL << slot))) {
+    return;
+  }
+  fs->pageDirty &= ~(1UL << slot);
+  UFAT_TRACE(("pageEvict:%i\r\n", victim));
+  pageIo(fs, 1, other, victim, pageData(fs, slot));
+  if (sectorBit(fs, fs->spilled, victim)) {
+    return;
+  }
+  group = victim >> fs->dirtyShift;
+  end = (group + 1) << fs->dirtyShift;
+  end = end > fs->tableSectors ? fs->tableSectors : end;
+  for (page = group << fs->dirtyShift; page < end; page++) {
+    if (page == victim) {
+      continue;
+    }
+    held = pageFind(fs, page);
+    if (held >= 0) {
+      fs->pageDirty &= ~(1UL << held);
+      pageIo(fs, 1, other, page, pageData(fs, held));
+    } else if (!pageIo(fs, 0, fs->tableIndex, page, pageData(fs, slot))) {
+      pageIo(fs, 1, other, page, pageData(fs, slot));
+    }
+  }
+  fs->spilled[group / 32] |= 1UL << (group % 32);
+}
+
+/* Slot holding a table sector, loaded in place of the least recently used
+ * one. The slot of the previous call is never the one reused */
+static uint32_t pageGet(ufat_fs_t *fs, uint32_t page) {
+  uint32_t i, age;
+  uint32_t oldest = 0;
+  int32_t slot = pageFind(fs, page);
+  if (slot < 0) {
+    for (i = 0; i < fs->pageSlots; i++) {
+      age = fs->pageTag[i] == UFAT_NO_PAGE ? 0xFFFFFFFF
+                                          : fs->pageClock - fs->pageUse[i];
+      if (slot < 0 || age > oldest) {
+        oldest = age;
+        slot = i;
+      }
+    }
+    pageEvict(fs, slot);
+    if (pageIo(fs, 0, pageSource(fs, page), page, pageData(fs, slot))) {
+      /* Nothing in it reads as free, the IO error stops commits */
+      memset(pageData(fs, slot), 0, fs->sectorSize);
+    }
+    fs->pageTag[slot] = page;
+  }
+  fs->pageUse[slot] = ++fs->pageClock;
+  fs->pageLast = slot;
+  return slot;
+}
+
+/* Working table bytes at offset, within one table sector. len marks that
+ * many changed. A paged table keeps the last two returned valid */
+static uint8_t *tableAt(ufat_fs_t *fs, uint32_t offset, uint32_t len) {
+  uint32_t slot;
+  if (len) {
+    tableDirty(fs, offset, len);
+  }
+  if (fs->fat) {
+    return &((uint8_t *)fs->fat)[offset];
+  }
+  slot = pageGet(fs, offset / fs->sectorSize);
+  if (len) {
+    fs->pageDirty |= 1UL << slot;
+  }
+  return &pageData(fs, slot)[offset % fs->sectorSize];
+}
+
+#define entryAt(fs, i)                                                         \
+  ((ufat_sector_t *)tableAt(fs, UFAT_TABLE_SIZE(i), 0))
+#define entryEdit(fs, i)                                                       \
+  ((ufat_sector_t *)tableAt(fs, UFAT_TABLE_SIZE(i), sizeof(ufat_sector_t)))
+#define headerAt(fs) ((ufat_table_header_t *)tableAt(fs, 0, 0))
+#define headerEdit(fs)                                                         \
+  ((ufat_table_header_t *)tableAt(fs, 0, sizeof(ufat_table_header_t)))
+
+static void freeSector(ufat_fs_t *fs, uint32_t sector);
+
+static int32_t scanTable(ufat_fs_t *fs) {
   uint32_t i;
   uint32_t wasRepaired = 0;
+  ufat_sector_t *e;
   UFAT_TRACE(("scanTable()\r\n"));
-  for (i = (UFAT_TABLE_COUNT * fs->tableSectors); i < fs->sectors; i++) {
-    if (!fat->sector[i].written && !fat->sector[i].available) {
+  for (i = fs->firstCluster; i < fs->clusters; i++) {
+    e = entryAt(fs, i);
+    if (!e->written && !e->available) {
       UFAT_DEBUG(("Sector %i recovered\r\n", i));
       UFAT_TRACE(("SECTOR:recover %i\r\n", i));
-      fat->sector[i].available = 1;
+      freeSector(fs, i);
       wasRepaired = 1;
     }
   }
   return wasRepaired;
 }
 
-static int32_t copyTable(ufat_fs_t *fs, uint32_t toIndex, uint32_t fromIndex) {
-  UFAT_TRACE(("copyTable(%i -> %i)\r\n", fromIndex, toIndex));
-  if (fs->read_block_device(
-          fs->addressStart + ((fs->sectorSize * fs->tableSectors) * fromIndex),
-          (uint8_t *)fs->buff, (fs->sectorSize * fs->tableSectors))) {
-    fs->lastError = UFAT_ERR_IO;
-    UFAT_TRACE(("UFAT_ERR_IO\r\n"));
-    return UFAT_ERR_IO;
+static uint32_t tableGeneration(ufat_table_header_t *header) {
+  if (header->magic != UFAT_TABLE_MAGIC ||
+      !(header->features & UFAT_FEATURE_PING_PONG)) {
+    return 0;
   }
-  if (fs->write_block_device(
-          fs->addressStart + ((fs->sectorSize * fs->tableSectors) * toIndex),
-          (uint8_t *)fs->buff, (fs->sectorSize * fs->tableSectors))) {
+  return header->generation;
+}
+
+/* Rewrites a bad or old copy from the working table */
+static int32_t repairTable(ufat_fs_t *fs, uint32_t toIndex) {
+  uint32_t i, last;
+  UFAT_TRACE(("repairTable(%i)\r\n", toIndex));
+  if (!fs->fat) {
+    last = (tableLength(fs, headerAt(fs)) - 1) / fs->sectorSize;
+    for (i = 0; i <= last; i++) {
+      if (pageIo(fs, 1, toIndex, i, pageData(fs, pageGet(fs, i)))) {
+        return UFAT_ERR_IO;
+      }
+    }
+    return UFAT_OK;
+  }
+  if (fs->write_block_device(fs->addressStart + (UFAT_COPY_SIZE(fs) * toIndex),
+                             (uint8_t *)fs->fat,
+                             tableLength(fs, &fs->fat->header))) {
     fs->lastError = UFAT_ERR_IO;
     UFAT_TRACE(("UFAT_ERR_IO\r\n"));
     return UFAT_ERR_IO;
@@ -121,9 +741,79 @@ static int32_t copyTable(ufat_fs_t *fs, uint32_t toIndex, uint32_t fromIndex) {
   return UFAT_OK;
 }
 
+/* Checks a copy a sector at a time in the first two page slots, against
+ * the sector CRCs. Other layouts take the whole table and read as bad */
+static int32_t validatePaged(ufat_fs_t *fs, uint32_t tableIndex,
+                             ufat_table_header_t *header) {
+  uint8_t *data = pageData(fs, 0);
+  uint8_t *crcs = pageData(fs, 1);
+  uint32_t i, n, page, payload, count, at, end, crc, stored;
+  uint32_t loaded = UFAT_NO_PAGE;
+  ufat_table_header_t h;
+  UFAT_TRACE(("validatePaged(%i)\r\n", tableIndex));
+  pageReset(fs);
+  if (pageIo(fs, 0, tableIndex, 0, data)) {
+    return UFAT_ERR_IO;
+  }
+  memcpy(&h, data, sizeof(h));
+  payload = tablePayload(fs, &h);
+  if (payload == 0 || !sectorCrcs(&h) ||
+      tableLength(fs, &h) > UFAT_COPY_SIZE(fs)) {
+    UFAT_TRACE(("validatePaged:layout\r\n"));
+    return UFAT_TABLE_CRC;
+  }
+  count = (payload + fs->sectorSize - 1) / fs->sectorSize;
+  at = UFAT_ALIGN4(payload);
+  end = at + (sizeof(uint32_t) * count);
+  crc = 0xFFFFFFFF;
+  for (i = at; i < end; i += n) {
+    loaded = i / fs->sectorSize;
+    if (pageIo(fs, 0, tableIndex, loaded, crcs)) {
+      return UFAT_ERR_IO;
+    }
+    n = fs->sectorSize - (i % fs->sectorSize);
+    n = n > end - i ? end - i : n;
+    crc = UFAT_FS_CRC(fs, &crcs[i % fs->sectorSize], n, crc);
+  }
+  if (crc != h.tableCrc) {
+    UFAT_TRACE(("validatePaged:failure 0x%X != 0x%X\r\n", crc, h.tableCrc));
+    return UFAT_TABLE_CRC;
+  }
+  for (i = 0; i < count; i++) {
+    page = (at + (sizeof(uint32_t) * i)) / fs->sectorSize;
+    if ((i && pageIo(fs, 0, tableIndex, i, data)) ||
+        (page != loaded && pageIo(fs, 0, tableIndex, page, crcs))) {
+      return UFAT_ERR_IO;
+    }
+    loaded = page;
+    memcpy(&stored,
+           &crcs[(at + (sizeof(uint32_t) * i)) % fs->sectorSize],
+           sizeof(stored));
+    if (sectorCRC(fs, payload, data, i) != stored) {
+      UFAT_TRACE(("validatePaged:sector %i\r\n", i));
+      return UFAT_TABLE_CRC;
+    }
+  }
+  if (header) {
+    *header = h;
+  }
+  UFAT_TRACE(("validatePaged:CRC 0x%X\r\n", crc));
+  UFAT_DEBUG(("Table %i crc match 0x%X\r\n", tableIndex, crc));
+  return UFAT_TABLE_GOOD;
+}
+
 static uint32_t loadTable(ufat_fs_t *fs, uint32_t tableIndex) {
   uint32_t crcRes;
+  int32_t res;
   UFAT_TRACE(("loadTable(%i)\r\n", tableIndex));
+  if (!fs->fat) {
+    /* Sectors load from the copy as they are used */
+    res = validatePaged(fs, tableIndex, NULL);
+    if (res == UFAT_TABLE_GOOD) {
+      return UFAT_OK;
+    }
+    return res == UFAT_ERR_IO ? UFAT_ERR_IO : UFAT_ERR_CRC;
+  }
   if (fs->read_block_device(
           fs->addressStart + ((fs->sectorSize * fs->tableSectors) * tableIndex),
           (uint8_t *)fs->fat, (fs->sectorSize * fs->tableSectors))) {
@@ -144,12 +834,16 @@ static uint32_t loadTable(ufat_fs_t *fs, uint32_t tableIndex) {
 }
 
 
+/* Reads a copy into fat, which may be the working table, or checks it in
+ * place with a paged table */
 static int32_t validateTable(ufat_fs_t *fs, uint32_t tableIndex,
-                             uint32_t *crc) {
+                             ufat_table_header_t *header, ufat_table_t *fat) {
   int32_t res = UFAT_TABLE_GOOD;
   uint32_t crcRes;
-  ufat_table_t *fat = (ufat_table_t *)fs->buff;
   UFAT_TRACE(("validateTable(%i)\r\n", tableIndex));
+  if (!fs->fat) {
+    return validatePaged(fs, tableIndex, header);
+  }
   if (fs->read_block_device(
           fs->addressStart + ((fs->sectorSize * fs->tableSectors) * tableIndex),
           (uint8_t *)fat, (fs->sectorSize * fs->tableSectors))) {
@@ -161,35 +855,118 @@ static int32_t validateTable(ufat_fs_t *fs, uint32_t tableIndex,
   crcRes = calcTableCRC(fs, fat);
   if (crcRes != fat->tableCrc) {
     UFAT_TRACE(("validateTable:failure actual 0x%X != stored 0x%X (%i)\r\n", crcRes,
-                  fat->tableCrc, UFAT_TABLE_SIZE(fs->sectors)));
+                  fat->tableCrc, tableLength(fs, &fat->header)));
     return UFAT_TABLE_CRC;
   }
-  if (crc) {
-    *crc = crcRes;
+  if (header) {
+    *header = fat->header;
   }
   UFAT_TRACE(("validateTable:CRC 0x%X\r\n", crcRes));
   UFAT_DEBUG(("Table %i crc match 0x%X\r\n", tableIndex, crcRes));
   return res;
 }
 
+static void mapBuild(ufat_fs_t *fs) {
+  uint32_t i;
+  fs->freeCount = 0;
+  if (fs->freeMap) {
+    memset(fs->freeMap, 0, sizeof(uint32_t) * ((fs->clusters + 31) / 32));
+  }
+  for (i = fs->firstCluster; i < fs->clusters; i++) {
+    if (entryAt(fs, i)->available) {
+      fs->freeCount++;
+      if (fs->freeMap) {
+        fs->freeMap[i / 32] |= 1UL << (i % 32);
+      }
+    }
+  }
+}
+
+static void allocSector(ufat_fs_t *fs, uint32_t sector) {
+  entryEdit(fs, sector)->available = 0;
+  fs->freeCount--;
+  if (fs->freeMap) {
+    fs->freeMap[sector / 32] &= ~(1UL << (sector % 32));
+  }
+}
+
+static void freeSector(ufat_fs_t *fs, uint32_t sector) {
+  ufat_sector_t *e = entryEdit(fs, sector);
+  if ((fs->transaction || (fs->options & UFAT_OPT_WRITE_BACK)) &&
+      e->written) {
+    /* Held until the commit, the media table may still reference it */
+    if (!e->pending) {
+      fs->pendingCount++;
+    }
+    e->pending = 1;
+    e->written = 0;
+    e->sof = 0;
+    e->next = UFAT_MAX_SECTORS;
+    return;
+  }
+  if (!e->available) {
+    fs->freeCount++;
+  }
+  e->available = 1;
+  e->written = 0;
+  e->sof = 0;
+  e->next = UFAT_MAX_SECTORS;
+  if (fs->freeMap) {
+    fs->freeMap[sector / 32] |= 1UL << (sector % 32);
+  }
+}
+
+static void pendingRelease(ufat_fs_t *fs) {
+  uint32_t i;
+  for (i = fs->firstCluster; fs->pendingCount && i < fs->clusters; i++) {
+    if (entryAt(fs, i)->pending) {
+      entryEdit(fs, i)->pending = 0;
+      fs->pendingCount--;
+      freeSector(fs, i);
+    }
+  }
+}
+
+static uint32_t randomSector(ufat_fs_t *fs) {
+  uint32_t sp = UFAT_RAND() % fs->clusters;
+  if (sp < fs->firstCluster) {
+    sp = fs->clusters / 2;
+  }
+  return sp;
+}
+
 static int32_t findEmptySector(ufat_fs_t *fs) {
   uint32_t i;
-  // int32_t res;
-  uint32_t sp = UFAT_RAND() % fs->sectors;
+  uint32_t words, bits;
+  uint32_t sp = randomSector(fs);
   UFAT_TRACE(("findEmptySector().."));
-  if (sp < (UFAT_TABLE_COUNT * fs->tableSectors)) {
-    sp = fs->sectors / 2;
+  if (fs->freeMap) {
+    /* Reserved sectors and bits past the end are never set */
+    words = (fs->clusters + 31) / 32;
+    i = sp / 32;
+    bits = fs->freeMap[i] & (0xFFFFFFFFUL << (sp % 32));
+    for (sp = 0; sp <= words; sp++) {
+      if (bits) {
+        i = (i * 32) + UFAT_CTZ(bits);
+        allocSector(fs, i);
+        UFAT_TRACE(("[%i]\r\n", i));
+        return i;
+      }
+      i = (i + 1) % words;
+      bits = fs->freeMap[i];
+    }
+    return UFAT_ERR_FULL;
   }
-  for (i = sp; i < fs->sectors; i++) {
-    if (fs->fat->sector[i].available) {
-      fs->fat->sector[i].available = 0;
+  for (i = sp; i < fs->clusters; i++) {
+    if (entryAt(fs, i)->available) {
+      allocSector(fs, i);
       UFAT_TRACE(("[%i]\r\n", i));
       return i;
     }
   }
-  for (i = (UFAT_TABLE_COUNT * fs->tableSectors); i < sp; i++) {
-    if (fs->fat->sector[i].available) {
-      fs->fat->sector[i].available = 0;
+  for (i = fs->firstCluster; i < sp; i++) {
+    if (entryAt(fs, i)->available) {
+      allocSector(fs, i);
       UFAT_TRACE(("[%i]\r\n", i));
       return i;
     }
@@ -197,83 +974,755 @@ static int32_t findEmptySector(ufat_fs_t *fs) {
   return UFAT_ERR_FULL;
 }
 
+static int sectorFree(ufat_fs_t *fs, uint32_t sector) {
+  if (fs->freeMap) {
+    return (fs->freeMap[sector / 32] >> (sector % 32)) & 1;
+  }
+  return entryAt(fs, sector)->available;
+}
+
+/* First free run of want sectors from start on, else the longest one */
+static int32_t findRun(ufat_fs_t *fs, uint32_t start, uint32_t want,
+                       uint32_t *runLen) {
+  uint32_t n, run = 0, best = 0, bestStart = 0;
+  uint32_t first = fs->firstCluster;
+  uint32_t i = start < first || start >= fs->clusters ? first : start;
+  for (n = first; n < fs->clusters; n++, i++) {
+    if (i == fs->clusters) {
+      i = first;
+      run = 0;
+    }
+    if (fs->freeMap && (i % 32) == 0 && fs->freeMap[i / 32] == 0 &&
+        i + 32 <= fs->clusters) {
+      /* Whole word in use */
+      run = 0;
+      n += 31;
+      i += 31;
+      continue;
+    }
+    if (!sectorFree(fs, i)) {
+      run = 0;
+      continue;
+    }
+    if (++run > best) {
+      best = run;
+      bestStart = i + 1 - run;
+      if (best >= want) {
+        break;
+      }
+    }
+  }
+  if (best == 0) {
+    return UFAT_ERR_FULL;
+  }
+  *runLen = best;
+  return bestStart;
+}
+
+static int flushTable(ufat_fs_t *fs);
+
+/* Next sector for a stream, from its reserved run with UFAT_OPT_CONTIGUOUS */
+static int32_t streamSector(ufat_fs_t *fs, ufat_FILE *stream) {
+  uint32_t want, len, i, start;
+  int32_t run;
+  if (!fs->freeCount && fs->pendingCount && !fs->transaction) {
+    /* Deferred frees are released by a flush */
+    flushTable(fs);
+  }
+  if (!(fs->options & UFAT_OPT_CONTIGUOUS)) {
+    return findEmptySector(fs);
+  }
+  if (stream->reserveNext == stream->reserveEnd) {
+    if (stream->sizeHint > stream->position) {
+      want = stream->sizeHint - stream->position;
+      if (stream->currentSector == -1) {
+        want += sizeof(ufat_file_t);
+      }
+      want = (want + fs->clusterSize - 1) / fs->clusterSize;
+    } else if (stream->currentSector == -1) {
+      want = UFAT_EXTENT_MIN;
+    } else {
+      /* Double the file */
+      want = (stream->position + sizeof(ufat_file_t)) / fs->clusterSize;
+    }
+    want = want < UFAT_EXTENT_MIN ? UFAT_EXTENT_MIN : want;
+    want = want > UFAT_EXTENT_MAX ? UFAT_EXTENT_MAX : want;
+    /* Prefer to continue right after the current sector */
+    start = stream->currentSector == -1 ? randomSector(fs)
+                                        : (uint32_t)stream->currentSector + 1;
+    run = findRun(fs, start, want, &len);
+    if (run < 0) {
+      return run;
+    }
+    for (i = run; i < run + len; i++) {
+      allocSector(fs, i);
+    }
+    UFAT_TRACE(("streamSector:reserve[%i..%i]\r\n", run, run + len - 1));
+    stream->reserveNext = run;
+    stream->reserveEnd = run + len;
+  }
+  return stream->reserveNext++;
+}
+
+static void releaseReserve(ufat_fs_t *fs, ufat_FILE *stream) {
+  for (; stream->reserveNext < stream->reserveEnd; stream->reserveNext++) {
+    freeSector(fs, stream->reserveNext);
+  }
+}
+
+/* len is 16 bits unless the volume has UFAT_FEATURE_LARGE_FILES */
+static uint32_t fileLength(const ufat_file_t *fh) {
+  return fh->len | ((uint32_t)fh->lenHigh << 16);
+}
+
+static void fileLengthSet(ufat_file_t *fh, uint32_t len) {
+  fh->len = (uint16_t)len;
+  fh->lenHigh = (uint16_t)(len >> 16);
+}
+
+static uint32_t fileLimit(ufat_fs_t *fs) {
+  return fs->features & UFAT_FEATURE_LARGE_FILES ? 0xFFFFFFFF : 0xFFFF;
+}
+
+/* Longest name, a full length one ends in a zero lenHigh */
+static uint32_t nameLimit(ufat_fs_t *fs) {
+  return sizeof(((ufat_file_t *)0)->name) -
+         (fs->features & UFAT_FEATURE_LARGE_FILES ? 1 : 0);
+}
+
+static uint32_t nameHash(const char *name) {
+  /* FNV-1a */
+  uint32_t i;
+  uint32_t hash = 0x811C9DC5;
+  for (i = 0; i < UFAT_MAX_NAMELEN && name[i]; i++) {
+    hash ^= (uint8_t)name[i];
+    hash *= 0x01000193;
+  }
+  return hash;
+}
+
+static int readHeader(ufat_fs_t *fs, uint32_t sector) {
+  if (fs->read_block_device(fs->addressStart + (sector * fs->clusterSize),
+                            fs->buff, sizeof(ufat_file_t))) {
+    fs->lastError = UFAT_ERR_IO;
+    UFAT_TRACE(("UFAT_ERR_IO\r\n"));
+    return UFAT_ERR_IO;
+  }
+  return UFAT_OK;
+}
+
+/* Wait for the asynchronous transfer in flight, if any */
+static int ioWait(ufat_fs_t *fs) {
+  if (!fs->inFlight) {
+    return UFAT_OK;
+  }
+  fs->inFlight = 0;
+  if (fs->complete_block_device()) {
+    fs->lastError = UFAT_ERR_IO;
+    UFAT_TRACE(("ioWait:UFAT_ERR_IO\r\n"));
+    return UFAT_ERR_IO;
+  }
+  return UFAT_OK;
+}
+
+/* Put a transfer on the bus once the previous one has completed */
+static int ioStart(ufat_fs_t *fs, int write, uint32_t offset, uint8_t *data,
+                   uint32_t len) {
+  if (ioWait(fs)) {
+    return UFAT_ERR_IO;
+  }
+  if (fs->submit_block_device(fs->addressStart + offset, data, len, write)) {
+    fs->lastError = UFAT_ERR_IO;
+    UFAT_TRACE(("ioStart:UFAT_ERR_IO\r\n"));
+    return UFAT_ERR_IO;
+  }
+  fs->inFlight = 1;
+  return UFAT_OK;
+}
+
+static uint8_t *nextStage(ufat_fs_t *fs) {
+  fs->stageNext ^= 1;
+  return fs->stage[fs->stageNext];
+}
+
+/* Transfer the queued segments, one driver submission when the driver takes
+ * a vector. The list stays in fs->iov for the caller */
+static int ioSubmit(ufat_fs_t *fs, int write) {
+  uint32_t i;
+  uint32_t count = fs->iovUsed;
+  uint32_t err = 0;
+  ufat_iovec_t *v = fs->iov;
+  fs->iovUsed = 0;
+  if (ioWait(fs)) {
+    return UFAT_ERR_IO;
+  }
+  if (count == 0) {
+    return UFAT_OK;
+  }
+  if (write && fs->writev_block_device) {
+    err = fs->writev_block_device(v, count);
+  } else if (!write && fs->readv_block_device) {
+    err = fs->readv_block_device(v, count);
+  } else {
+    for (i = 0; i < count && !err; i++) {
+      err = write ? fs->write_block_device(v[i].address, v[i].data, v[i].len)
+                  : fs->read_block_device(v[i].address, v[i].data, v[i].len);
+    }
+  }
+  if (err) {
+    fs->lastError = UFAT_ERR_IO;
+    UFAT_TRACE(("ioSubmit:UFAT_ERR_IO\r\n"));
+    return UFAT_ERR_IO;
+  }
+  return UFAT_OK;
+}
+
+/* Queue a segment at a volume offset, a full list is submitted first. A
+ * segment continuing the last one on both the media and in memory, as a run
+ * of adjacent sectors does, extends it instead */
+static int ioQueue(ufat_fs_t *fs, int write, uint32_t offset, uint8_t *data,
+                   uint32_t len) {
+  ufat_iovec_t *v;
+  if (fs->iovUsed) {
+    v = &fs->iov[fs->iovUsed - 1];
+    if (v->address + v->len == fs->addressStart + offset &&
+        v->data + v->len == data) {
+      v->len += len;
+      return UFAT_OK;
+    }
+  }
+  if (fs->iovUsed == UFAT_IOV_COUNT && ioSubmit(fs, write)) {
+    return UFAT_ERR_IO;
+  }
+  v = &fs->iov[fs->iovUsed++];
+  v->address = fs->addressStart + offset;
+  v->data = data;
+  v->len = len;
+  return UFAT_OK;
+}
+
+/* Sector of the k-th segment of the last submission */
+static uint32_t ioSector(ufat_fs_t *fs, uint32_t k) {
+  return (fs->iov[k].address - fs->addressStart) / fs->clusterSize;
+}
+
+/* Read the headers of file start sectors from *sector on into fs->buff as
+ * one submission, as many as the list and buffer hold. Returns the count,
+ * see ioSector, and moves *sector past the last one */
+static int32_t headerBatch(ufat_fs_t *fs, uint32_t *sector,
+                           uint32_t writtenOnly) {
+  uint32_t count = 0;
+  uint32_t max = UFAT_BUFF_SIZE(fs) / sizeof(ufat_file_t);
+  ufat_sector_t *e;
+  max = max > UFAT_IOV_COUNT ? UFAT_IOV_COUNT : max;
+  for (; *sector < fs->clusters && count < max; (*sector)++) {
+    e = entryAt(fs, *sector);
+    if (e->sof && (e->written || !writtenOnly)) {
+      ioQueue(fs, 0, *sector * fs->clusterSize,
+              fs->buff + (count++ * sizeof(ufat_file_t)), sizeof(ufat_file_t));
+    }
+  }
+  if (ioSubmit(fs, 0)) {
+    return UFAT_ERR_IO;
+  }
+  return count;
+}
+
+/* Slots are moved a field at a time, one may straddle two table sectors */
+static void slotGet(ufat_fs_t *fs, uint32_t i, ufat_dir_slot_t *slot) {
+  uint32_t at = UFAT_DIR_OFFSET(fs->clusters) + (i * sizeof(ufat_dir_slot_t));
+  slot->hash = *(uint32_t *)tableAt(fs, at, 0);
+  slot->sector = *(uint32_t *)tableAt(fs, at + sizeof(uint32_t), 0);
+}
+
+static void slotSet(ufat_fs_t *fs, uint32_t i, uint32_t hash,
+                    uint32_t sector) {
+  uint32_t at = UFAT_DIR_OFFSET(fs->clusters) + (i * sizeof(ufat_dir_slot_t));
+  *(uint32_t *)tableAt(fs, at, sizeof(uint32_t)) = hash;
+  *(uint32_t *)tableAt(fs, at + sizeof(uint32_t), sizeof(uint32_t)) = sector;
+}
+
+static int nameTableValid(ufat_fs_t *fs) {
+  return (fs->features & UFAT_FEATURE_DIR_TABLE) &&
+         !(headerAt(fs)->state & UFAT_STATE_DIR_OVERFLOW);
+}
+
+static void nameTableInsert(ufat_fs_t *fs, uint32_t hash, uint32_t sector) {
+  uint32_t i, probe;
+  uint32_t slots = headerAt(fs)->dirSlots;
+  ufat_dir_slot_t slot;
+  if (!nameTableValid(fs)) {
+    return;
+  }
+  for (probe = 0, i = hash % slots; probe < slots; probe++) {
+    slotGet(fs, i, &slot);
+    if (slot.sector == 0) {
+      slotSet(fs, i, hash, sector);
+      return;
+    }
+    i = (i + 1) % slots;
+  }
+  UFAT_TRACE(("nameTableInsert:overflow\r\n"));
+  headerEdit(fs)->state |= UFAT_STATE_DIR_OVERFLOW;
+}
+
+static void nameTableRemove(ufat_fs_t *fs, uint32_t hash, uint32_t sector) {
+  uint32_t i, j, home, probe;
+  uint32_t slots = headerAt(fs)->dirSlots;
+  ufat_dir_slot_t slot;
+  if (!nameTableValid(fs)) {
+    return;
+  }
+  for (probe = 0, i = hash % slots; probe < slots; probe++) {
+    slotGet(fs, i, &slot);
+    if (slot.sector == 0) {
+      return;
+    }
+    if (slot.sector == sector) {
+      break;
+    }
+    i = (i + 1) % slots;
+  }
+  if (probe == slots) {
+    return;
+  }
+  /* Backward shift so probe chains stay unbroken */
+  for (j = (i + 1) % slots;; j = (j + 1) % slots) {
+    slotGet(fs, j, &slot);
+    if (slot.sector == 0) {
+      break;
+    }
+    home = slot.hash % slots;
+    if ((j > i && (home <= i || home > j)) ||
+        (j < i && (home <= i && home > j))) {
+      slotSet(fs, i, slot.hash, slot.sector);
+      i = j;
+    }
+  }
+  slotSet(fs, i, 0, 0);
+}
+
+static int32_t dirFind(ufat_fs_t *fs, const char *fileName) {
+  uint32_t i;
+  uint32_t hash = nameHash(fileName);
+  for (i = 0; i < fs->dirCount; i++) {
+    if (fs->dir[i].hash != hash) {
+      continue;
+    }
+    if (!fs->dir[i].loaded) {
+      if (readHeader(fs, fs->dir[i].sector)) {
+        return UFAT_ERR_IO;
+      }
+      memcpy(&fs->dir[i].fh, fs->buff, sizeof(ufat_file_t));
+      fs->dir[i].loaded = 1;
+    }
+    if (strncmp(fs->dir[i].fh.name, fileName, UFAT_MAX_NAMELEN) == 0) {
+      return i;
+    }
+  }
+  return UFAT_FILE_NOT_FOUND;
+}
+
+static void dirRemove(ufat_fs_t *fs, uint32_t hash, uint32_t sector) {
+  uint32_t i;
+  nameTableRemove(fs, hash, sector);
+  if (!fs->dirValid) {
+    return;
+  }
+  for (i = 0; i < fs->dirCount; i++) {
+    if (fs->dir[i].sector == sector) {
+      fs->dir[i] = fs->dir[--fs->dirCount];
+      return;
+    }
+  }
+}
+
+static void dirAppend(ufat_fs_t *fs, uint32_t hash, uint32_t sector,
+                      ufat_file_t *fh) {
+  ufat_dir_entry_t *e;
+  if (!fs->dirValid) {
+    return;
+  }
+  if (fs->dirCount >= fs->dirEntries) {
+    /* Index overflow, lookups fall back to the media */
+    UFAT_TRACE(("dirAppend:index full\r\n"));
+    fs->dirValid = 0;
+    return;
+  }
+  e = &fs->dir[fs->dirCount++];
+  e->hash = hash;
+  e->sector = sector;
+  e->loaded = fh != NULL;
+  if (fh) {
+    memcpy(&e->fh, fh, sizeof(ufat_file_t));
+  }
+}
+
+static void dirInsert(ufat_fs_t *fs, uint32_t sector, ufat_file_t *fh) {
+  uint32_t hash = nameHash(fh->name);
+  nameTableInsert(fs, hash, sector);
+  dirAppend(fs, hash, sector, fh);
+}
+
+/* Returns 1 when the name table was rebuilt and needs a commit */
+static int dirBuild(ufat_fs_t *fs) {
+  uint32_t i;
+  int32_t k, count;
+  int rebuild = 0;
+  uint32_t slots = headerAt(fs)->dirSlots;
+  ufat_dir_slot_t slot;
+  fs->dirCount = 0;
+  fs->dirValid = fs->dir && fs->dirEntries;
+  UFAT_TRACE(("dirBuild()\r\n"));
+  if (nameTableValid(fs)) {
+    /* Headers are read on first lookup */
+    for (i = 0; i < slots && fs->dirValid; i++) {
+      slotGet(fs, i, &slot);
+      if (slot.sector != 0) {
+        dirAppend(fs, slot.hash, slot.sector, NULL);
+      }
+    }
+    UFAT_TRACE(("dirBuild:%i files from name table\r\n", fs->dirCount));
+    return UFAT_OK;
+  }
+  if (fs->features & UFAT_FEATURE_DIR_TABLE) {
+    for (i = 0; i < slots; i++) {
+      slotSet(fs, i, 0, 0);
+    }
+    headerEdit(fs)->state &= ~UFAT_STATE_DIR_OVERFLOW;
+    rebuild = 1;
+  }
+  i = fs->firstCluster;
+  while (i < fs->clusters && (fs->dirValid || rebuild)) {
+    count = headerBatch(fs, &i, 1);
+    if (count < 0) {
+      fs->dirValid = 0;
+      return UFAT_ERR_IO;
+    }
+    for (k = 0; k < count; k++) {
+      dirInsert(fs, ioSector(fs, k), (ufat_file_t *)fs->buff + k);
+    }
+  }
+  UFAT_TRACE(("dirBuild:%i files\r\n", fs->dirCount));
+  /* Still overflowing, the stored copy is as good as this one */
+  return rebuild && nameTableValid(fs);
+}
+
 static int fileSearch(ufat_fs_t *fs, const char *fileName, uint32_t *sector,
                       ufat_file_t *fh, uint32_t *len) {
-  uint32_t i;
+  uint32_t i, probe, hash, slots;
+  int32_t entry, k, count;
   int foundFile = UFAT_ERR_FILE_NOT_FOUND;
+  ufat_dir_slot_t slot;
   *sector = UFAT_INVALID_SECTOR;
   ufat_file_t *fhbuff = (ufat_file_t *)fs->buff;
   UFAT_TRACE(("fileSearch(%s)..", fileName));
-  for (i = UFAT_FIRST_SECTOR(fs->tableSectors); i < fs->sectors; i++) {
-    if (fs->fat->sector[i].sof) {
-      if (fs->read_block_device(fs->addressStart + (i * fs->sectorSize),
-                                fs->buff, sizeof(ufat_file_t))) {
-        fs->lastError = UFAT_ERR_IO;
-        UFAT_TRACE(("UFAT_ERR_IO\r\n"));
+  if (fs->dirValid) {
+    entry = dirFind(fs, fileName);
+    if (entry == UFAT_ERR_IO) {
+      return UFAT_ERR_IO;
+    }
+    if (entry == UFAT_FILE_NOT_FOUND) {
+      UFAT_TRACE(("index miss\r\n"));
+      return UFAT_ERR_FILE_NOT_FOUND;
+    }
+    *sector = fs->dir[entry].sector;
+    if (fh) {
+      memcpy(fh, &fs->dir[entry].fh, sizeof(ufat_file_t));
+    }
+    if (len) {
+      *len = fileLength(&fs->dir[entry].fh);
+    }
+    UFAT_TRACE(("index hit [%i]\r\n", *sector));
+    return UFAT_OK;
+  }
+  if (nameTableValid(fs)) {
+    hash = nameHash(fileName);
+    slots = headerAt(fs)->dirSlots;
+    for (probe = 0, i = hash % slots; probe < slots; probe++) {
+      slotGet(fs, i, &slot);
+      if (slot.sector == 0) {
+        break;
+      }
+      if (slot.hash == hash) {
+        if (readHeader(fs, slot.sector)) {
+          return UFAT_ERR_IO;
+        }
+        if (strncmp(fhbuff->name, fileName, UFAT_MAX_NAMELEN) == 0) {
+          *sector = slot.sector;
+          foundFile = UFAT_OK;
+          break;
+        }
+      }
+      i = (i + 1) % slots;
+    }
+  } else {
+    i = fs->firstCluster;
+    while (i < fs->clusters && foundFile != UFAT_OK) {
+      count = headerBatch(fs, &i, 1);
+      if (count < 0) {
+        return UFAT_ERR_IO;
+      }
+      for (k = 0; k < count; k++) {
+        UFAT_TRACE(("[%s]", fhbuff[k].name));
+        if (strncmp(fhbuff[k].name, fileName, UFAT_MAX_NAMELEN) == 0) {
+          *sector = ioSector(fs, k);
+          fhbuff += k;
+          foundFile = UFAT_OK;
+          break;
+        }
+      }
+    }
+  }
+  if (foundFile == UFAT_OK) {
+    if (fh) {
+      memcpy(fh, fhbuff, sizeof(ufat_file_t));
+    }
+    if (len) {
+      *len = fileLength(fhbuff);
+    }
+  }
+  UFAT_TRACE(("\r\n"));
+  return foundFile;
+}
+
+/* Refresh the sector CRCs of dirty table sectors, then tableCrc */
+static void tableSeal(ufat_fs_t *fs) {
+  uint32_t i, n, count, payload, at, end, crc;
+  /* Sector 0 holds tableCrc and is always rewritten */
+  tableDirty(fs, 0, sizeof(uint32_t));
+  if (fs->features & UFAT_FEATURE_PING_PONG) {
+    headerEdit(fs)->generation++;
+  }
+  if (!sectorCrcs(headerAt(fs))) {
+    fs->fat->tableCrc = calcTableCRC(fs, fs->fat);
+    return;
+  }
+  payload = tablePayload(fs, headerAt(fs));
+  count = (payload + fs->sectorSize - 1) / fs->sectorSize;
+  at = UFAT_ALIGN4(payload);
+  end = at + (sizeof(uint32_t) * count);
+  for (i = 0; i < count; i++) {
+    if (sectorDirty(fs, i)) {
+      crc = sectorCRC(fs, payload, tableAt(fs, i * fs->sectorSize, 0), i);
+      *(uint32_t *)tableAt(fs, at + (sizeof(uint32_t) * i),
+                           sizeof(uint32_t)) = crc;
+    }
+  }
+  /* A sector at a time, the CRCs may span several */
+  crc = 0xFFFFFFFF;
+  for (i = at; i < end; i += n) {
+    n = fs->sectorSize - (i % fs->sectorSize);
+    n = n > end - i ? end - i : n;
+    crc = UFAT_FS_CRC(fs, tableAt(fs, i, 0), n, crc);
+  }
+  headerEdit(fs)->tableCrc = crc;
+}
+
+static int copyNeeds(ufat_fs_t *fs, uint32_t stale, uint32_t sector) {
+  return sectorDirty(fs, sector) ||
+         (stale && sectorBit(fs, fs->stale, sector));
+}
+
+/* Paged writeTable, a sector not in a slot is skipped when its newest
+ * version is already in that copy and loaded first otherwise */
+static int writePaged(ufat_fs_t *fs, uint32_t tableIndex, uint32_t stale) {
+  uint32_t i, len;
+  int32_t slot;
+  uint32_t last = (fs->tableBytes - 1) / fs->sectorSize;
+  for (i = 0; i <= last; i++) {
+    if (!copyNeeds(fs, stale, i)) {
+      continue;
+    }
+    slot = pageFind(fs, i);
+    if (slot < 0) {
+      if (pageSource(fs, i) == tableIndex) {
+        continue;
+      }
+      slot = pageGet(fs, i);
+    }
+    len = fs->tableBytes - (i * fs->sectorSize);
+    len = len > fs->sectorSize ? fs->sectorSize : len;
+    UFAT_TRACE(("commitChanges:Program[%i] %i\r\n", tableIndex, i));
+    if (fs->write_block_device(fs->addressStart +
+                                   (UFAT_COPY_SIZE(fs) * tableIndex) +
+                                   (i * fs->sectorSize),
+                               pageData(fs, slot), len)) {
+      return UFAT_ERR_IO;
+    }
+  }
+  if (fs->lastError == UFAT_ERR_IO) {
+    return UFAT_ERR_IO;
+  }
+  /* The other copy holds the slots now, evictions while the current copy is
+   * written must not tear it */
+  if (tableIndex != fs->tableIndex) {
+    fs->pageDirty = 0;
+  }
+  return UFAT_OK;
+}
+
+/* A copy matches the working table outside the dirty sectors, and the stale
+ * ones for the older copy, so only runs of those are rewritten */
+static int writeTable(ufat_fs_t *fs, uint32_t tableIndex, uint32_t stale) {
+  uint32_t lo, hi, start, end;
+  uint32_t last = (fs->tableBytes - 1) / fs->sectorSize;
+  if (!fs->fat) {
+    return writePaged(fs, tableIndex, stale);
+  }
+  for (lo = 0; lo <= last; lo = hi + 1) {
+    hi = lo;
+    if (!copyNeeds(fs, stale, lo)) {
+      continue;
+    }
+    while (hi < last && copyNeeds(fs, stale, hi + 1)) {
+      hi++;
+    }
+    start = lo * fs->sectorSize;
+    end = (hi + 1) * fs->sectorSize;
+    end = end > fs->tableBytes ? fs->tableBytes : end;
+    UFAT_TRACE(("commitChanges:Program[%i] %i..%i\r\n", tableIndex, lo, hi));
+    if (fs->write_block_device(
+            fs->addressStart + (UFAT_COPY_SIZE(fs) * tableIndex) + start,
+            &((uint8_t *)fs->fat)[start], end - start)) {
+      return UFAT_ERR_IO;
+    }
+  }
+  return UFAT_OK;
+}
+
+static int flushTable(ufat_fs_t *fs) {
+  uint32_t i, first;
+  UFAT_TRACE(("flushTable..\r\n"));
+  if (fs->lastError == UFAT_ERR_IO || ioWait(fs)) {
+    return UFAT_ERR_IO;
+  }
+  pendingRelease(fs);
+  tableSeal(fs);
+  UFAT_TRACE(("TESTCRC: 0x%X\r\n", headerAt(fs)->tableCrc));
+  if ((fs->features & UFAT_FEATURE_PING_PONG) && !fs->clean) {
+    /* A torn write leaves the newest copy to mount */
+    if (writeTable(fs, fs->tableIndex ^ 1, 1)) {
+      return UFAT_ERR_IO;
+    }
+    fs->tableIndex ^= 1;
+    memcpy(fs->stale, fs->dirty, sizeof(fs->stale));
+  } else {
+    /* The other copy may be unread after a clean mount, so it goes first
+     * and the current copy stays whole if that write tears */
+    first = fs->tableIndex ^ 1;
+    for (i = 0; i < UFAT_TABLE_COUNT; i++) {
+      if (writeTable(fs, first ^ i, (first ^ i) != fs->tableIndex)) {
         return UFAT_ERR_IO;
       }
-      UFAT_TRACE(("[%s]", fhbuff->name));
-      if (strncmp(fhbuff->name, fileName, UFAT_MAX_NAMELEN) == 0) {
-        *sector = i;
-        if (fh) {
-          memcpy(fh, fs->buff, sizeof(ufat_file_t));
-        }
-        if (len) {
-          ufat_file_t *f = (ufat_file_t *)fs->buff;
-          *len = f->len;
-        }
-        foundFile = UFAT_OK;
-        break;
-      }
     }
+    memset(fs->stale, 0, sizeof(fs->stale));
+    fs->clean = 0;
   }
-  UFAT_TRACE(("\r\n"));
-  return foundFile;
+  /* Kept dirty after a failure so the next commit covers it again */
+  tableClean(fs);
+  fs->deferredOps = 0;
+  return UFAT_OK;
+}
+
+static int commitDue(ufat_fs_t *fs) {
+  if (!fs->deferredOps || fs->transaction) {
+    return 0;
+  }
+  if (fs->commitOps && fs->deferredOps >= fs->commitOps) {
+    return 1;
+  }
+  return fs->clock && (int32_t)(fs->clock() - fs->deadline) >= 0;
 }
 
+/* Flushes unless a transaction or UFAT_OPT_WRITE_BACK holds it back */
 static int commitChanges(ufat_fs_t *fs) {
-  UFAT_TRACE(("commitChanges..\r\n"));
   if (fs->lastError == UFAT_ERR_IO) {
     return UFAT_ERR_IO;
   }
-  fs->fat->tableCrc = calcTableCRC(fs, fs->fat);
-  // validateTable(fs, 0, &i);
-  UFAT_TRACE(("TESTCRC: 0x%X\r\n", fs->fat->tableCrc));
-  /* Copy 1 */
-  UFAT_TRACE(("commitChanges:Program[0]\r\n"));
-  if (fs->write_block_device(fs->addressStart, (uint8_t *)fs->fat,
-                             UFAT_TABLE_SIZE(fs->sectors))) {
-    return UFAT_ERR_IO;
+  if (fs->transaction) {
+    UFAT_TRACE(("commitChanges:transaction\r\n"));
+    return UFAT_OK;
   }
-  /* Copy 2 */
-  UFAT_TRACE(("commitChanges:Program[1]\r\n"));
-  if (fs->write_block_device(
-          fs->addressStart + (fs->tableSectors * fs->sectorSize),
-          (uint8_t *)fs->fat, UFAT_TABLE_SIZE(fs->sectors))) {
-    return UFAT_ERR_IO;
+  if (fs->options & UFAT_OPT_WRITE_BACK) {
+    if (fs->deferredOps++ == 0 && fs->clock) {
+      fs->deadline = fs->clock() + fs->commitTicks;
+    }
+    if (!commitDue(fs)) {
+      UFAT_TRACE(("commitChanges:deferred %i\r\n", fs->deferredOps));
+      return UFAT_OK;
+    }
+  }
+  return flushTable(fs);
+}
+
+/* With a clusterShift every table entry, and every "sector" of the file
+ * code, is a cluster of 2^clusterShift sectors. fs->buff must hold one */
+static void clusterGeometry(ufat_fs_t *fs) {
+  uint32_t header =
+      (sizeof(ufat_table_header_t) + sizeof(ufat_sector_t) - 1) /
+      sizeof(ufat_sector_t);
+  UFAT_ASSERT((1UL << fs->clusterShift) <= fs->tableSectors);
+  fs->clusterSize = fs->sectorSize << fs->clusterShift;
+  fs->clusters = fs->sectors >> fs->clusterShift;
+  fs->firstCluster = (fs->tableSectors * UFAT_TABLE_COUNT +
+                      (1UL << fs->clusterShift) - 1) >>
+                     fs->clusterShift;
+  /* The header and state overlay the entries of the table copies, which
+   * may be too few once they are clusters */
+  if (fs->clusterShift && fs->firstCluster < header) {
+    fs->firstCluster = header;
   }
-  return UFAT_OK;
 }
 
 int ufat_mount(ufat_fs_t *fs) {
   int32_t t1State, t2State;
-  uint32_t crc1, crc2;
+  ufat_table_header_t h1, h2, *header;
   uint32_t scenario;
-  uint32_t res;
+  uint32_t pingPong;
+  int32_t res;
+  int32_t repaired;
   uint32_t tablesValid = 0;
   UFAT_ASSERT(fs);
   UFAT_ASSERT(fs->buff);
-  UFAT_ASSERT(fs->fat);
-  UFAT_ASSERT(fs->sectors < UFAT_MAX_SECTORS);
+  UFAT_ASSERT(fs->fat || (fs->pages && fs->pageSlots >= 2 &&
+                          fs->pageSlots <= UFAT_PAGE_SLOTS));
+  clusterGeometry(fs);
+  fs->crcFold = UFAT_CRC_FOLD();
+  UFAT_ASSERT(fs->clusters < UFAT_MAX_SECTORS);
   UFAT_ASSERT(fs->read_block_device);
   UFAT_ASSERT(fs->write_block_device);
-  UFAT_TRACE(("ufat_mount:Table Bytes = 0x%X\r\n", UFAT_TABLE_SIZE(fs->sectors)));
+  UFAT_ASSERT(!fs->submit_block_device ||
+              (fs->complete_block_device && fs->stage[0] && fs->stage[1]));
+  UFAT_TRACE(
+      ("ufat_mount:Table Bytes = 0x%X\r\n", UFAT_TABLE_SIZE(fs->clusters)));
   fs->lastError = UFAT_OK;
-  t1State = validateTable(fs, 0, &crc1);
-  t2State = validateTable(fs, 1, &crc2);
+  fs->transaction = 0;
+  fs->pendingCount = 0;
+  fs->deferredOps = 0;
+  fs->clean = 0;
+  fs->iovUsed = 0;
+  fs->inFlight = 0;
+  tableClean(fs);
+  pageReset(fs);
+  /* Each copy is read once, copy 0 straight into the working table */
+  t1State = validateTable(fs, 0, &h1, fs->fat);
+  if (t1State == UFAT_TABLE_GOOD && (h1.state & UFAT_STATE_CLEAN)) {
+    /* Clean unmount, copy 0 is current and the other copy stays unread */
+    UFAT_TRACE(("ufat_mount:clean\r\n"));
+    fs->tableIndex = 0;
+    t2State = UFAT_TABLE_GOOD;
+    goto loaded;
+  }
+  t2State = validateTable(fs, 1, &h2, (ufat_table_t *)fs->buff);
   if (t1State == UFAT_TABLE_GOOD && t2State == UFAT_TABLE_GOOD &&
-      crc1 != crc2) {
-    t2State = UFAT_TABLE_OLD;
+      h1.tableCrc != h2.tableCrc) {
+    /* Generations are 0 without UFAT_FEATURE_PING_PONG */
+    if ((int32_t)(tableGeneration(&h2) - tableGeneration(&h1)) > 0) {
+      t1State = UFAT_TABLE_OLD;
+    } else {
+      t2State = UFAT_TABLE_OLD;
+    }
   }
   if (t1State == UFAT_ERR_IO || t2State == UFAT_ERR_IO) {
     return UFAT_ERR_IO;
@@ -283,23 +1732,27 @@ int ufat_mount(ufat_fs_t *fs) {
     UFAT_DEBUG(("Mounted volume is empty\r\n"));
     return UFAT_ERR_EMPTY;
   } 
+  /* Ping pong copies are expected to differ, the first commit rewrites the
+   * older copy in full */
+  header = t1State == UFAT_TABLE_GOOD ? &h1 : &h2;
+  pingPong = header->magic == UFAT_TABLE_MAGIC &&
+             (header->features & UFAT_FEATURE_PING_PONG);
   scenario = (t1State << 4) + t2State;
+  fs->tableIndex = 0;
   switch (scenario) {
   case 0x00: /* |GOOD |GOOD | */
-    res = loadTable(fs, 0);
-    if (res) {
-      return res;
-    }
     tablesValid = 1;
     break;
+  case 0x10: /* | OLD |GOOD | */
+    /* fallthrough */
   case 0x20: /* | BAD |GOOD | */
-    /* Repair */
-    res = copyTable(fs, 0, 1);
-    if (res) {
-      return res;
-    }
     /* Load */
-    res = loadTable(fs, 1);
+    if (fs->fat) {
+      memcpy(fs->fat, fs->buff, UFAT_COPY_SIZE(fs));
+    }
+    fs->tableIndex = 1;
+    /* Repair */
+    res = pingPong ? UFAT_OK : repairTable(fs, 0);
     if (res) {
       return res;
     }
@@ -308,11 +1761,7 @@ int ufat_mount(ufat_fs_t *fs) {
   case 0x01: /* |GOOD | OLD | */
     /* fallthrough */
   case 0x02: /* |GOOD | BAD | */
-    res = copyTable(fs, 1, 0);
-    if (res) {
-      return res;
-    }
-    res = loadTable(fs, 0);
+    res = pingPong ? UFAT_OK : repairTable(fs, 1);
     if (res) {
       return res;
     }
@@ -331,8 +1780,26 @@ int ufat_mount(ufat_fs_t *fs) {
     return UFAT_ERR_CORRUPT;
   }
   UFAT_TRACE(("ufat_mount:0x%02X\r\n", scenario));
+loaded:
+  header = headerAt(fs);
+  fs->features = header->magic == UFAT_TABLE_MAGIC ? header->features : 0;
+  fs->tableBytes = tableLength(fs, header);
+  tableClean(fs);
+  /* The first commit replaces both copies of a clean table */
+  fs->clean = (header->state & UFAT_STATE_CLEAN) != 0;
+  headerEdit(fs)->state &= ~UFAT_STATE_CLEAN;
+  memset(fs->stale,
+         (fs->features & UFAT_FEATURE_PING_PONG) || fs->clean ? 0xFF : 0,
+         sizeof(fs->stale));
   /* scan for unclosed files */
-  if (scanTable(fs, fs->fat)) {
+  repaired = fs->clean ? 0 : scanTable(fs);
+  mapBuild(fs);
+  res = dirBuild(fs);
+  /* A paged table may have failed a load in the scans */
+  if (res == UFAT_ERR_IO || fs->lastError == UFAT_ERR_IO) {
+    return UFAT_ERR_IO;
+  }
+  if (repaired || res) {
     commitChanges(fs);
     UFAT_DEBUG(("Tables repaired\r\n"));
     UFAT_TRACE(("ufat_mount:tables repaired\r\n"));
@@ -345,39 +1812,70 @@ int ufat_mount(ufat_fs_t *fs) {
 
 int ufat_format(ufat_fs_t *fs) {
   uint32_t i;
+  ufat_sector_t *e;
+  ufat_table_header_t *header;
   UFAT_ASSERT(fs);
   UFAT_ASSERT(fs->buff);
-  UFAT_ASSERT(fs->fat);
-  UFAT_ASSERT(fs->sectors < UFAT_MAX_SECTORS);
+  UFAT_ASSERT(fs->fat || (fs->pages && fs->pageSlots >= 2 &&
+                          fs->pageSlots <= UFAT_PAGE_SLOTS));
+  /* A paged table is only checked and sealed a sector at a time */
+  UFAT_ASSERT(fs->fat || (fs->formatFeatures & UFAT_FEATURE_SECTOR_CRC));
+  clusterGeometry(fs);
+  fs->crcFold = UFAT_CRC_FOLD();
+  UFAT_ASSERT(fs->clusters < UFAT_MAX_SECTORS);
   /* Minimum sector space for tableCrc */
   UFAT_ASSERT(fs->tableSectors > sizeof(uint32_t) / sizeof(ufat_sector_t));
   UFAT_ASSERT(fs->read_block_device);
   UFAT_ASSERT(fs->write_block_device);
+  UFAT_ASSERT(!(fs->formatFeatures & ~UFAT_FEATURE_ALL));
   UFAT_TRACE(("ufat_format()\r\n"));
+  fs->lastError = UFAT_OK;
+  fs->transaction = 0;
+  fs->pendingCount = 0;
+  fs->deferredOps = 0;
+  fs->clean = 0;
+  fs->iovUsed = 0;
+  fs->inFlight = 0;
+  fs->tableIndex = 0;
+  memset(fs->stale, 0, sizeof(fs->stale));
+  tableClean(fs);
+  pageReset(fs);
+  for (i = 0; i < fs->tableSectors; i++) {
+    memset(tableAt(fs, i * fs->sectorSize, fs->sectorSize), 0,
+           fs->sectorSize);
+  }
+  if (fs->formatFeatures) {
+    /* Header lives in the reserved entries */
+    UFAT_ASSERT(UFAT_TABLE_SIZE(fs->firstCluster) >=
+                sizeof(ufat_table_header_t));
+    header = headerEdit(fs);
+    header->magic = UFAT_TABLE_MAGIC;
+    header->features = fs->formatFeatures;
+    if (fs->formatFeatures & UFAT_FEATURE_DIR_TABLE) {
+      UFAT_ASSERT(fs->dirSlots > 0 && fs->dirSlots <= 0xFFFF);
+      header->dirSlots = fs->dirSlots;
+    }
+  }
+  fs->features = fs->formatFeatures;
+  fs->tableBytes = tableLength(fs, headerAt(fs));
   /* check sizes */
-  UFAT_ASSERT(fs->tableSectors * fs->sectorSize <=
-              UFAT_TABLE_SIZE(fs->sectors));
-  memset(fs->fat, 0, fs->tableSectors * fs->sectorSize);
-  for (i = UFAT_FIRST_SECTOR(fs->tableSectors); i < fs->sectors; i++) {
-    fs->fat->sector[i].next = UFAT_MAX_SECTORS;
-    fs->fat->sector[i].available = 1;
-    fs->fat->sector[i].sof = 0;
-    fs->fat->sector[i].written = 0;
-  }
-  fs->fat->tableCrc = calcTableCRC(fs, fs->fat);
-  /* Copy 1 */
-  if (fs->write_block_device(fs->addressStart, (uint8_t *)fs->fat,
-                             UFAT_TABLE_SIZE(fs->sectors))) {
-    UFAT_TRACE(("UFAT_ERR_IO\r\n"));
-    return UFAT_ERR_IO;
+  UFAT_ASSERT(fs->tableBytes <= UFAT_COPY_SIZE(fs));
+  for (i = fs->firstCluster; i < fs->clusters; i++) {
+    e = entryEdit(fs, i);
+    e->next = UFAT_MAX_SECTORS;
+    e->available = 1;
+    e->sof = 0;
+    e->written = 0;
   }
-  /* Copy 2 */
-  if (fs->write_block_device(fs->addressStart +
-                                 (fs->tableSectors * fs->sectorSize),
-          (uint8_t *)fs->fat, UFAT_TABLE_SIZE(fs->sectors))) {
+  memset(fs->dirty, 0xFF, sizeof(fs->dirty));
+  tableSeal(fs);
+  /* Copy 1, then copy 2 */
+  if (writeTable(fs, 0, 0) || writeTable(fs, 1, 0) ||
+      fs->lastError == UFAT_ERR_IO) {
     UFAT_TRACE(("UFAT_ERR_IO\r\n"));
     return UFAT_ERR_IO;
   }
+  tableClean(fs);
   UFAT_INFO(("Volume is formatted\r\n"));
   UFAT_TRACE(("FORMAT:done\r\n"));
   return UFAT_OK;
@@ -388,12 +1886,13 @@ int ufat_fsinfo(ufat_fs_t *fs, char *buff, int32_t maxLen) {
   UFAT_ASSERT(fs->volumeMounted);
   char *pin = buff;
   uint32_t i, len;
+  int32_t k, count;
   uint32_t bytesFree = 0;
   uint32_t bytesUsed = 0;
   uint32_t bytesAvailable = 0;
   uint32_t fileCount = 0;
-  uint32_t tableOverhead =
-      (fs->tableSectors * UFAT_TABLE_COUNT * fs->sectorSize);
+  uint32_t capacity = (fs->clusters - fs->firstCluster) * fs->clusterSize;
+  ufat_sector_t *e;
   ufat_file_t f;
   struct tm ts;
   time_t now;
@@ -401,47 +1900,356 @@ int ufat_fsinfo(ufat_fs_t *fs, char *buff, int32_t maxLen) {
   len = UFAT_INFO_SNPRINT(
       (buff, maxLen,
        "\r\nuFAT Version %s"
-       "\r\nVolume info:Capacity %9i B\r\n",
-       UFAT_VERSION,
-       (fs->sectors * fs->sectorSize) - tableOverhead));
+       "\r\nVolume info:Capacity %9u B\r\n",
+       UFAT_VERSION, capacity));
   maxLen -= len;
   buff += len;
-  for (i = (UFAT_TABLE_COUNT * fs->tableSectors); i < fs->sectors; i++) {
-    if (fs->fat->sector[i].sof) {
-      if (fs->read_block_device(fs->addressStart + (i * fs->sectorSize),
-                                fs->buff, sizeof(ufat_file_t))) {
-        return UFAT_ERR_IO;
-      }
-
-      memcpy(&f, fs->buff, sizeof(ufat_file_t));
+  for (i = fs->firstCluster; i < fs->clusters; i++) {
+    e = entryAt(fs, i);
+    if (!e->sof && e->available) {
+      bytesAvailable += fs->clusterSize;
+      bytesFree += fs->clusterSize;
+    }
+  }
+  i = fs->firstCluster;
+  while (i < fs->clusters) {
+    count = headerBatch(fs, &i, 0);
+    if (count < 0) {
+      return UFAT_ERR_IO;
+    }
+    for (k = 0; k < count; k++) {
+      memcpy(&f, (ufat_file_t *)fs->buff + k, sizeof(ufat_file_t));
       now = (time_t)f.timeStamp;
       ts = *localtime(&now);
       strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &ts);
-      len = UFAT_INFO_SNPRINT((buff, maxLen > 0 ? maxLen : 0, "%s  %9i %s\r\n",
-                               buf, (int)f.len, f.name));
+      len = UFAT_INFO_SNPRINT((buff, maxLen > 0 ? maxLen : 0, "%s  %9u %s\r\n",
+                               buf, (unsigned)fileLength(&f), f.name));
       maxLen -= len;
       buff += len;
-      bytesUsed += f.len;
+      bytesUsed += fileLength(&f);
       fileCount++;
-    } else if (fs->fat->sector[i].available) {
-      bytesAvailable += fs->sectorSize;
-      bytesFree += fs->sectorSize;
-    } 
+    }
   }
 
   buff += UFAT_INFO_SNPRINT((buff, maxLen > 0 ? maxLen : 0,
                                "     Files    %9i\r\n"
-                               "     Used     %9i\r\n"
-                               "     Free     %9i\r\n",
+                               "     Used     %9u\r\n"
+                               "     Free     %9u\r\n",
                                fileCount, bytesUsed, bytesFree));
   return (int)(buff - pin);
 }
 
+uint32_t ufat_freecount(ufat_fs_t *fs) {
+  UFAT_ASSERT(fs);
+  UFAT_ASSERT(fs->volumeMounted);
+  return fs->freeCount;
+}
+
+/* Closes and removes until ufat_commit() only change the RAM table */
+int ufat_begin(ufat_fs_t *fs) {
+  UFAT_ASSERT(fs);
+  UFAT_ASSERT(fs->volumeMounted);
+  UFAT_ASSERT(!fs->transaction);
+  UFAT_TRACE(("ufat_begin()\r\n"));
+  if (fs->lastError == UFAT_ERR_IO) {
+    return UFAT_ERR_IO;
+  }
+  /* ufat_abort() reloads the media table, so it must hold the earlier work */
+  if (fs->deferredOps && flushTable(fs)) {
+    return UFAT_ERR_IO;
+  }
+  fs->transaction = 1;
+  return UFAT_OK;
+}
+
+/* One table commit for the whole transaction, atomic like a single close */
+int ufat_commit(ufat_fs_t *fs) {
+  UFAT_ASSERT(fs);
+  UFAT_ASSERT(fs->volumeMounted);
+  UFAT_ASSERT(fs->transaction);
+  UFAT_TRACE(("ufat_commit()\r\n"));
+  fs->transaction = 0;
+  return commitChanges(fs);
+}
+
+/* Reloads the committed table, files opened for writing during the
+ * transaction must not be used afterwards */
+int ufat_abort(ufat_fs_t *fs) {
+  int32_t res;
+  uint32_t i;
+  UFAT_ASSERT(fs);
+  UFAT_ASSERT(fs->volumeMounted);
+  UFAT_ASSERT(fs->transaction);
+  UFAT_TRACE(("ufat_abort()\r\n"));
+  fs->transaction = 0;
+  fs->pendingCount = 0;
+  if (fs->lastError == UFAT_ERR_IO) {
+    return UFAT_ERR_IO;
+  }
+  /* Evictions left the transaction in these groups of the other copy */
+  for (i = 0; i < UFAT_DIRTY_WORDS; i++) {
+    fs->stale[i] |= fs->spilled[i];
+  }
+  res = loadTable(fs, fs->tableIndex);
+  if (res) {
+    fs->lastError = res == UFAT_ERR_IO ? res : UFAT_ERR_CORRUPT;
+    return fs->lastError;
+  }
+  tableClean(fs);
+  mapBuild(fs);
+  res = dirBuild(fs);
+  if (res == UFAT_ERR_IO) {
+    return res;
+  }
+  return res ? commitChanges(fs) : UFAT_OK;
+}
+
+/* Frees the sectors of files left open, flushes and marks both copies clean
+ * so the next mount reads one copy and skips recovery */
+int ufat_unmount(ufat_fs_t *fs) {
+  int ret;
+  UFAT_ASSERT(fs);
+  UFAT_ASSERT(fs->volumeMounted);
+  UFAT_ASSERT(!fs->transaction);
+  UFAT_TRACE(("ufat_unmount()\r\n"));
+  if (fs->lastError == UFAT_ERR_IO) {
+    return UFAT_ERR_IO;
+  }
+  scanTable(fs);
+  headerEdit(fs)->state |= UFAT_STATE_CLEAN;
+  fs->clean = 1;
+  ret = flushTable(fs);
+  headerEdit(fs)->state &= ~UFAT_STATE_CLEAN;
+  if (ret) {
+    fs->clean = 1;
+    return ret;
+  }
+  fs->volumeMounted = 0;
+  UFAT_INFO(("Volume is unmounted\r\n"));
+  return UFAT_OK;
+}
+
+/* Flushes commits deferred by UFAT_OPT_WRITE_BACK, an open transaction
+ * stays in RAM */
+int ufat_sync(ufat_fs_t *fs) {
+  UFAT_ASSERT(fs);
+  UFAT_ASSERT(fs->volumeMounted);
+  UFAT_TRACE(("ufat_sync()\r\n"));
+  if (fs->lastError == UFAT_ERR_IO) {
+    return UFAT_ERR_IO;
+  }
+  if (!fs->deferredOps || fs->transaction) {
+    return UFAT_OK;
+  }
+  return flushTable(fs);
+}
+
+/* Write the head sector from the content of sector from with the new header
+ * to stream->headCopy, then make that the file start in place of the old
+ * head. Nothing reaches the media table until the commit */
+static int headSwap(ufat_fs_t *fs, ufat_FILE *stream, uint32_t from) {
+  uint32_t head = stream->startSector;
+  uint32_t copy = stream->headCopy;
+  ufat_sector_t *e;
+  if (fs->read_block_device(fs->addressStart + (from * fs->clusterSize),
+                            fs->buff, fs->clusterSize)) {
+    fs->lastError = UFAT_ERR_IO;
+    return UFAT_ERR_IO;
+  }
+  memcpy(fs->buff, &stream->fh, sizeof(ufat_file_t));
+  if (fs->write_block_device(fs->addressStart + (copy * fs->clusterSize),
+                             fs->buff, fs->clusterSize)) {
+    fs->lastError = UFAT_ERR_IO;
+    return UFAT_ERR_IO;
+  }
+  e = entryEdit(fs, copy);
+  e->sof = 1;
+  e->written = 1;
+  dirRemove(fs, nameHash(stream->fh.name), head);
+  freeSector(fs, head);
+  dirInsert(fs, copy, &stream->fh);
+  stream->startSector = copy;
+  return UFAT_OK;
+}
+
+/* "a" continues the chain at its tail. The media table keeps the old file
+ * until ufat_fclose links the new sectors and swaps in a head copy with the
+ * new header, so a power loss leaves either version */
+static int appendOpen(ufat_fs_t *fs, ufat_FILE *file, uint32_t head) {
+  uint32_t count = 1;
+  uint32_t tail = head;
+  int32_t copy;
+  while (entryAt(fs, tail)->next != UFAT_EOF) {
+    tail = entryAt(fs, tail)->next;
+    if (tail < fs->firstCluster || tail >= fs->clusters ||
+        ++count > fs->clusters) {
+      return UFAT_ERR_CORRUPT;
+    }
+  }
+  copy = findEmptySector(fs);
+  if (copy < 0) {
+    return copy;
+  }
+  file->startSector = head;
+  file->currentSector = tail;
+  file->position = fileLength(&file->fh);
+  /* The tail past len is unused, so it fills in place */
+  file->rwPosInSector =
+      file->position + sizeof(ufat_file_t) - ((count - 1) * fs->clusterSize);
+  file->appendTail = tail;
+  file->appendLink = UFAT_EOF;
+  file->headCopy = copy;
+  UFAT_TRACE(("appendOpen:head[%i] tail[%i] copy[%i]\r\n", head, tail, copy));
+  return UFAT_OK;
+}
+
+static int appendClose(ufat_fs_t *fs, ufat_FILE *stream) {
+  uint32_t limit = fs->clusters;
+  uint32_t head = stream->startSector;
+  uint32_t next = stream->appendLink;
+  if (next != UFAT_EOF) {
+    entryEdit(fs, stream->appendTail)->next = next;
+  }
+  for (; next != UFAT_EOF; next = entryAt(fs, next)->next) {
+    if (next < fs->firstCluster || next >= fs->clusters ||
+        --limit < 1) {
+      return UFAT_ERR_CORRUPT;
+    }
+    entryEdit(fs, next)->written = 1;
+  }
+  entryEdit(fs, stream->headCopy)->next = entryAt(fs, head)->next;
+  /* The tail may share the head sector */
+  return headSwap(fs, stream, head);
+}
+
+static int32_t cowFind(ufat_FILE *f, const ufat_link_t *list,
+                       uint32_t sector) {
+  uint32_t i;
+  for (i = 0; i < f->cowCount; i++) {
+    if (list[i] == sector) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Copy of sector made by a "r+" stream, or the sector itself */
+static uint32_t cowSector(ufat_FILE *f, uint32_t sector) {
+  int32_t i = cowFind(f, f->cowOld, sector);
+  return i < 0 ? sector : f->cowNew[i];
+}
+
+/* "r+" writes go to copies of the sectors they touch, the chain keeps the
+ * old sectors until ufat_fclose splices the copies in and commits */
+static size_t updateWrite(ufat_fs_t *fs, ufat_FILE *stream, uint8_t *data,
+                          uint32_t len) {
+  uint32_t n, next, sector, offset, at, span, copied;
+  int32_t copy;
+  uint8_t *old;
+  size_t written = len;
+  if (len > fileLength(&stream->fh) - stream->position) {
+    /* Overwrites only, "a" extends a file */
+    return stream->lastError = UFAT_ERR_RANGE;
+  }
+  while (len) {
+    if (stream->rwPosInSector == fs->clusterSize) {
+      next = entryAt(fs, stream->currentSector)->next;
+      if (next < fs->firstCluster || next >= fs->clusters) {
+        stream->error = 1;
+        return stream->lastError = UFAT_ERR_CORRUPT;
+      }
+      stream->currentSector = cowSector(stream, next);
+      stream->rwPosInSector = 0;
+    }
+    sector = stream->currentSector;
+    offset = stream->rwPosInSector;
+    n = fs->clusterSize - offset;
+    n = len > n ? n : len;
+    /* The first change copies the whole committed sector, a copy only
+     * takes the changed bytes after that */
+    copied = cowFind(stream, stream->cowNew, sector) >= 0;
+    at = copied ? offset : 0;
+    span = copied ? n : fs->clusterSize;
+    if (fs->read_block_device(
+            fs->addressStart + (sector * fs->clusterSize) + at, fs->buff,
+            span)) {
+      stream->error = 1;
+      return fs->lastError = stream->lastError = UFAT_ERR_IO;
+    }
+    if (!copied) {
+      if (stream->cowCount == UFAT_COW_SECTORS) {
+        stream->error = 1;
+        return stream->lastError = UFAT_ERR_COW_LIMIT;
+      }
+      copy = sector == stream->startSector ? (int32_t)stream->headCopy
+                                            : findEmptySector(fs);
+      if (copy < 0) {
+        stream->error = 1;
+        return stream->lastError = copy;
+      }
+      entryEdit(fs, copy)->next = entryAt(fs, sector)->next;
+      stream->cowOld[stream->cowCount] = sector;
+      stream->cowNew[stream->cowCount++] = copy;
+      stream->currentSector = sector = copy;
+    }
+    old = fs->buff + offset - at;
+    stream->fh.crc = ufat_crc32_patch(
+        stream->fh.crc, old, data, n,
+        fileLength(&stream->fh) - stream->position - n);
+    memcpy(old, data, n);
+    if (fs->write_block_device(
+            fs->addressStart + (sector * fs->clusterSize) + at, fs->buff,
+            span)) {
+      stream->error = 1;
+      return fs->lastError = stream->lastError = UFAT_ERR_IO;
+    }
+    stream->position += n;
+    stream->rwPosInSector += n;
+    data += n;
+    len -= n;
+  }
+  return written;
+}
+
+/* Splice the "r+" copies into the chain, a head copy carries the new CRC */
+static int updateClose(ufat_fs_t *fs, ufat_FILE *stream) {
+  uint32_t limit = fs->clusters;
+  uint32_t head = stream->startSector;
+  uint32_t prev = stream->headCopy;
+  uint32_t next, copy;
+  uint32_t current = entryAt(fs, head)->next;
+  if (cowSector(stream, head) == head) {
+    entryEdit(fs, prev)->next = current;
+  }
+  for (; current != UFAT_EOF; current = next) {
+    if (current < fs->firstCluster || current >= fs->clusters ||
+        --limit < 1) {
+      return UFAT_ERR_CORRUPT;
+    }
+    next = entryAt(fs, current)->next;
+    copy = cowSector(stream, current);
+    if (copy != current) {
+      entryEdit(fs, prev)->next = copy;
+      entryEdit(fs, copy)->written = 1;
+      freeSector(fs, current);
+    }
+    prev = copy;
+  }
+  return headSwap(fs, stream, cowSector(stream, head));
+}
+
+/* Mode string without its z suffix */
+static int modeIs(const char *mode, size_t len, const char *want) {
+  return strlen(want) == len && strncmp(mode, want, len) == 0;
+}
+
 int ufat_fopen(ufat_fs_t *fs, const char *filename, const char *mode,
                  ufat_FILE *file) {
 
   uint32_t sector;
   uint32_t flags;
+  uint32_t zeroCopy;
+  size_t modeLen;
   int retVal;
   UFAT_ASSERT(fs);
   UFAT_ASSERT(fs->volumeMounted);
@@ -449,27 +2257,41 @@ int ufat_fopen(ufat_fs_t *fs, const char *filename, const char *mode,
   if (fs->lastError == UFAT_ERR_IO) {
     return UFAT_ERR_IO;
   }
-  if (strcmp("r", mode) == 0) {
-    flags = UFAT_FLAG_READ;
+  if (commitDue(fs)) {
+    flushTable(fs);
+  }
+  modeLen = strlen(mode);
+  zeroCopy = 0;
+  if (modeLen > 1 && mode[modeLen - 1] == 'z') {
+    zeroCopy = UFAT_FLAG_ZERO_COPY;
+    modeLen--;
+  }
+  if (modeIs(mode, modeLen, "r")) {
+    flags = UFAT_FLAG_READ | zeroCopy;
 #ifdef UFAT_FILE_CHECK
     flags |= UFAT_FILE_CRC_CHECK;
 #endif
-  } else if (strcmp("rb", mode) == 0) {
-    flags = UFAT_FLAG_READ;
+  } else if (modeIs(mode, modeLen, "rb")) {
+    flags = UFAT_FLAG_READ | zeroCopy;
 #ifdef UFAT_FILE_CHECK
     flags |= UFAT_FILE_CRC_CHECK;
 #endif
-  } else if (strcmp("w", mode) == 0) {
-    flags = UFAT_FLAG_WRITE;
-  } else if (strcmp("wb", mode) == 0) {
-    flags = UFAT_FLAG_WRITE;
+  } else if (modeIs(mode, modeLen, "w")) {
+    flags = UFAT_FLAG_WRITE | zeroCopy;
+  } else if (modeIs(mode, modeLen, "wb")) {
+    flags = UFAT_FLAG_WRITE | zeroCopy;
+  } else if (modeIs(mode, modeLen, "r+") || modeIs(mode, modeLen, "rb+") ||
+             modeIs(mode, modeLen, "r+b")) {
+    flags = UFAT_FLAG_READ | UFAT_FLAG_WRITE | UFAT_FLAG_UPDATE | zeroCopy;
+  } else if (modeIs(mode, modeLen, "a") || modeIs(mode, modeLen, "ab")) {
+    flags = UFAT_FLAG_WRITE | UFAT_FLAG_APPEND | zeroCopy;
   } else {
     fs->lastError = UFAT_ERR_UNSUPPORTED;
     UFAT_TRACE(("ufat_fopen:unsupported\r\n"));
     return UFAT_ERR_UNSUPPORTED;
   }
   memset(file, 0, sizeof(ufat_FILE));
-  if (strlen(filename) >= UFAT_MAX_NAMELEN - 1) {
+  if (strlen(filename) > nameLimit(fs)) {
     file->lastError = UFAT_ERR_NAME_LEN;
     file->opened = 0;
     return UFAT_ERR_NAME_LEN;
@@ -485,6 +2307,15 @@ int ufat_fopen(ufat_fs_t *fs, const char *filename, const char *mode,
         file->zeroCopy = 1;
       }
       file->crcValidate = 0xFFFFFFFF;
+      if (flags & UFAT_FLAG_UPDATE) {
+        /* Taken now so ufat_fclose cannot run out of space */
+        retVal = findEmptySector(fs);
+        if (retVal < 0) {
+          return fs->lastError = file->lastError = retVal;
+        }
+        file->headCopy = retVal;
+        file->oldFileSector = UFAT_FILE_NOT_FOUND;
+      }
       file->opened = 1;
       UFAT_TRACE(("ufat_fopen:file opened for reading\r\n"));
       UFAT_DEBUG(("FILE %s opened for reading\r\n", filename));
@@ -508,15 +2339,26 @@ int ufat_fopen(ufat_fs_t *fs, const char *filename, const char *mode,
     file->startSector = UFAT_INVALID_SECTOR;
     file->openFlags = flags;
     file->currentSector = -1;
-    if (retVal == UFAT_OK) { // File found
+    if (flags & UFAT_FLAG_ZERO_COPY) {
+      file->zeroCopy = 1;
+    }
+    if (retVal == UFAT_OK && (flags & UFAT_FLAG_APPEND)) {
+      retVal = appendOpen(fs, file, sector);
+      if (retVal) {
+        fs->lastError = file->lastError = retVal;
+        return retVal;
+      }
+    } else if (retVal == UFAT_OK) { // File found
       file->oldFileSector = sector; // Mark for removal
-      UFAT_ASSERT(sector >= UFAT_TABLE_COUNT);
+      UFAT_ASSERT(sector >= fs->firstCluster);
       UFAT_DEBUG(("Sector %i marked for removal\r\n", sector));
       UFAT_TRACE(("ufat_fopen:sector[%i] marked to remove\r\n", sector));
     } else {
+      /* Appending to a new file is a plain write */
+      file->openFlags &= ~UFAT_FLAG_APPEND;
       memset(&file->fh, 0, sizeof(ufat_file_t));
-      strncpy(file->fh.name, filename, UFAT_MAX_NAMELEN);
-      file->fh.name[UFAT_MAX_NAMELEN - 1] = 0;
+      /* Checked against nameLimit, the zeroed lenHigh may end it */
+      memcpy(file->fh.name, filename, strlen(filename));
     }
     file->opened = 1;
     UFAT_TRACE(("ufat_fopen:file opened for writing\r\n"));
@@ -545,34 +2387,60 @@ int ufat_fclose(ufat_fs_t *fs, ufat_FILE *stream) {
   if (!stream->opened) {
     return stream->lastError;
   }
+  releaseReserve(fs, stream);
 
+  if (stream->openFlags & UFAT_FLAG_UPDATE &&
+      (stream->error || stream->cowCount == 0)) {
+    /* Unchanged, or the old file stays */
+    freeSector(fs, stream->headCopy);
+    for (current = 0; current < stream->cowCount; current++) {
+      if (stream->cowNew[current] != stream->headCopy) {
+        freeSector(fs, stream->cowNew[current]);
+      }
+    }
+    ret = stream->error ? stream->lastError : UFAT_OK;
+    goto finalize;
+  }
+  if (stream->error && stream->openFlags & UFAT_FLAG_APPEND) {
+    /* The old file stays, only the new sectors go */
+    freeSector(fs, stream->headCopy);
+    limit = fs->clusters;
+    for (current = stream->appendLink; current != UFAT_EOF; current = next) {
+      if (current < fs->firstCluster || current >= fs->clusters ||
+          --limit < 1) {
+        ret = UFAT_ERR_CORRUPT;
+        goto finalize;
+      }
+      next = entryAt(fs, current)->next;
+      freeSector(fs, current);
+    }
+    ret = fs->lastError;
+    goto finalize;
+  }
   if (stream->error && stream->openFlags & UFAT_FLAG_WRITE) {
     // invalidate the last
     if (stream->startSector != UFAT_INVALID_SECTOR) {
-      limit = fs->sectors;
+      limit = fs->clusters;
       current = stream->startSector;
-      next = fs->fat->sector[current].next;
+      next = entryAt(fs, current)->next;
       UFAT_DEBUG(("..INVALID[%i]..%i.%i", stream->position, current, next));
       UFAT_TRACE(("ufat_fclose:INVALID[%i]:%i.%i\r\n", stream->position,
                     current, next));
       for (;;) {
-        fs->fat->sector[current].available = 1;
-        fs->fat->sector[current].written = 0;
-        fs->fat->sector[current].sof = 0;
-        fs->fat->sector[current].next = UFAT_MAX_SECTORS;
+        freeSector(fs, current);
         if (next == UFAT_EOF ||
             (stream->lastError == UFAT_ERR_FULL && next == UFAT_MAX_SECTORS)) {
           break;
         }
-        if (next < UFAT_TABLE_COUNT ||
-            (next >= fs->sectors && next != UFAT_EOF)) {
+        if (next < fs->firstCluster ||
+            (next >= fs->clusters && next != UFAT_EOF)) {
           UFAT_ERROR(("Corrupt file system next = %i\r\n", next));
           UFAT_TRACE(("UFAT_ERR_CORRUPT next \r\n", next));
           ret = UFAT_ERR_CORRUPT;
           goto finalize;
         }
         current = next;
-        next = fs->fat->sector[next].next;
+        next = entryAt(fs, next)->next;
         UFAT_DEBUG((".%i", next));
         UFAT_TRACE((".%i", next));
         if (--limit < 1) {
@@ -586,23 +2454,36 @@ int ufat_fclose(ufat_fs_t *fs, ufat_FILE *stream) {
     ret = fs->lastError;
     goto finalize;
   }
-  if (stream->openFlags & UFAT_FLAG_WRITE &&
-      stream->startSector != UFAT_INVALID_SECTOR) {
+  if (stream->openFlags & UFAT_FLAG_APPEND) {
+    fileLengthSet(&stream->fh, stream->position);
+    stream->fh.timeStamp = time(NULL);
+    ret = appendClose(fs, stream);
+    if (ret) {
+      goto finalize;
+    }
+  } else if (stream->openFlags & UFAT_FLAG_UPDATE) {
+    stream->fh.timeStamp = time(NULL);
+    ret = updateClose(fs, stream);
+    if (ret) {
+      goto finalize;
+    }
+  } else if (stream->openFlags & UFAT_FLAG_WRITE &&
+             stream->startSector != UFAT_INVALID_SECTOR) {
     // Write the header
-    stream->fh.len = stream->position;
+    fileLengthSet(&stream->fh, stream->position);
     stream->fh.timeStamp = time(NULL);
     memcpy(fs->buff, &stream->fh, sizeof(ufat_file_t));
     if (fs->write_block_device(fs->addressStart +
-                                   (stream->startSector * fs->sectorSize),
+                                   (stream->startSector * fs->clusterSize),
                                fs->buff, sizeof(ufat_file_t))) {
       ret = UFAT_ERR_IO;
       goto finalize;
     }
     // Commit to _FAT table
-    fs->fat->sector[stream->startSector].written = 1;
-    limit = fs->sectors;
+    entryEdit(fs, stream->startSector)->written = 1;
+    limit = fs->clusters;
     current = stream->startSector;
-    next = fs->fat->sector[current].next;
+    next = entryAt(fs, current)->next;
     UFAT_DEBUG(("..WRITE[%i]..%i.%i.", stream->position, current, next));
     UFAT_TRACE(
         ("ufat_fclose:WRITE[%i]:%i.%i.", stream->position, current, next));
@@ -610,16 +2491,16 @@ int ufat_fclose(ufat_fs_t *fs, ufat_FILE *stream) {
       if (next == UFAT_EOF) {
         break;
       }
-      if (next < UFAT_TABLE_COUNT ||
-          (next >= fs->sectors && next != UFAT_EOF)) {
+      if (next < fs->firstCluster ||
+          (next >= fs->clusters && next != UFAT_EOF)) {
         UFAT_ERROR(("Corrupt file system next = %i\r\n", next));
         UFAT_TRACE(("UFAT_ERR_CORRUPT next \r\n", next));
         ret = UFAT_ERR_CORRUPT;
         goto finalize;
       }
-      fs->fat->sector[next].written = 1;
+      entryEdit(fs, next)->written = 1;
       current = next;
-      next = fs->fat->sector[next].next;
+      next = entryAt(fs, next)->next;
       UFAT_DEBUG(("%i.", next));
       UFAT_TRACE(("%i.", next));
       if (--limit < 1) {
@@ -629,33 +2510,32 @@ int ufat_fclose(ufat_fs_t *fs, ufat_FILE *stream) {
     }
     UFAT_DEBUG(("\r\n"));
     UFAT_TRACE(("\r\n"));
+    dirInsert(fs, stream->startSector, &stream->fh);
   }
 
   // Delete old file
   if (stream->openFlags & UFAT_FLAG_WRITE &&
       stream->oldFileSector != UFAT_FILE_NOT_FOUND) {
+    dirRemove(fs, nameHash(stream->fh.name), stream->oldFileSector);
 
-    limit = fs->sectors;
+    limit = fs->clusters;
     current = stream->oldFileSector;
-    next = fs->fat->sector[current].next;
+    next = entryAt(fs, current)->next;
     UFAT_TRACE(("ufat_fclose:DELETE:%i.%i.", current, next));
     for (;;) {
-      fs->fat->sector[current].available = 1;
-      fs->fat->sector[current].sof = 0;
-      fs->fat->sector[current].written = 0;
-      fs->fat->sector[current].next = UFAT_MAX_SECTORS;
+      freeSector(fs, current);
       if (next == UFAT_EOF) {
         break;
       }
-      if (next < UFAT_TABLE_COUNT ||
-          (next >= fs->sectors && next != UFAT_EOF)) {
+      if (next < fs->firstCluster ||
+          (next >= fs->clusters && next != UFAT_EOF)) {
         UFAT_ERROR(("Corrupt file system next = %i\r\n", next));
         UFAT_TRACE(("UFAT_ERR_CORRUPT next \r\n", next));
         ret = UFAT_ERR_CORRUPT;
         goto finalize;
       }
       current = next;
-      next = fs->fat->sector[next].next;
+      next = entryAt(fs, next)->next;
       UFAT_DEBUG(("%i.", next));
       UFAT_TRACE(("%i.", next));
       if (--limit < 1) {
@@ -686,6 +2566,27 @@ finalize:
   return ret;
 }
 
+/* Queue a chunk of ufat_fwrite and add it to the file CRC. Asynchronous
+ * drivers get it in a stage buffer, copied and hashed while the previous
+ * chunk is still on the bus, or straight from the caller with zeroCopy */
+static int writeChunk(ufat_fs_t *fs, ufat_FILE *stream, uint32_t offset,
+                      uint8_t *data, uint32_t len) {
+  uint8_t *stage;
+  if (!fs->submit_block_device) {
+    stream->fh.crc = UFAT_FS_CRC(fs, data, len, stream->fh.crc);
+    return ioQueue(fs, 1, offset, data, len);
+  }
+  if (stream->zeroCopy) {
+    /* The caller buffer stays put until ufat_fwrite returns */
+    stage = data;
+  } else {
+    stage = nextStage(fs);
+    memcpy(stage, data, len);
+  }
+  stream->fh.crc = UFAT_FS_CRC(fs, stage, len, stream->fh.crc);
+  return ioStart(fs, 1, offset, stage, len);
+}
+
 size_t ufat_fwrite(ufat_fs_t *fs, const void *ptr, size_t size, size_t count,
                      ufat_FILE *stream) {
   int32_t nextSector;
@@ -707,8 +2608,18 @@ size_t ufat_fwrite(ufat_fs_t *fs, const void *ptr, size_t size, size_t count,
   if (!stream->opened) {
     return stream->lastError;
   }
+  if (len > fileLimit(fs) - stream->position) {
+    /* Past what the header can record */
+    return stream->lastError = UFAT_ERR_RANGE;
+  }
+  if (stream->openFlags & UFAT_FLAG_UPDATE) {
+    return updateWrite(fs, stream, out, len);
+  }
+  if (commitDue(fs)) {
+    flushTable(fs);
+  }
   if (stream->currentSector == -1) {
-    stream->currentSector = findEmptySector(fs);
+    stream->currentSector = streamSector(fs, stream);
     if (stream->currentSector == UFAT_ERR_FULL) {
       stream->error = 1;
       stream->lastError = UFAT_ERR_FULL;
@@ -723,20 +2634,23 @@ size_t ufat_fwrite(ufat_fs_t *fs, const void *ptr, size_t size, size_t count,
     UFAT_DEBUG(("New file sector %i\r\n", stream->currentSector));
     UFAT_TRACE(("ufat_fwrite:add sector[%i]\r\n", stream->currentSector));
     // New file
-    fs->fat->sector[stream->currentSector].sof = 1;
+    entryEdit(fs, stream->currentSector)->sof = 1;
     stream->startSector = stream->currentSector;
     stream->rwPosInSector = sizeof(ufat_file_t);
     stream->fh.crc = 0xFFFFFFFF;
-    UFAT_ASSERT(stream->startSector >= UFAT_TABLE_COUNT &&
+    UFAT_ASSERT(stream->startSector >= fs->firstCluster &&
                   stream->startSector != UFAT_INVALID_SECTOR);
   }
   // At this point we should have a writeable area
 
   while (len) {
     // Calculate available space to write in this sector
-    writeable = fs->sectorSize - stream->rwPosInSector;
+    writeable = fs->clusterSize - stream->rwPosInSector;
     if (writeable == 0) {
-      nextSector = findEmptySector(fs);
+      nextSector = streamSector(fs, stream);
+      if (nextSector < 0 && ioSubmit(fs, 1)) {
+        nextSector = UFAT_ERR_IO;
+      }
       if (nextSector == UFAT_ERR_FULL) {
         stream->error = 1; // Flag for fclose delete
         stream->lastError = UFAT_ERR_FULL;
@@ -752,31 +2666,52 @@ size_t ufat_fwrite(ufat_fs_t *fs, const void *ptr, size_t size, size_t count,
                     stream->currentSector, nextSector));
       UFAT_DEBUG(("File sector added %i -> %i\r\n", stream->currentSector,
                     nextSector));
-      fs->fat->sector[stream->currentSector].next = nextSector;
-      fs->fat->sector[nextSector].sof = 0;
+      if ((stream->openFlags & UFAT_FLAG_APPEND) &&
+          (uint32_t)stream->currentSector == stream->appendTail) {
+        /* The committed tail is linked at close */
+        stream->appendLink = nextSector;
+      } else {
+        entryEdit(fs, stream->currentSector)->next = nextSector;
+      }
+      entryEdit(fs, nextSector)->sof = 0;
       stream->currentSector = nextSector;
-      writeable = fs->sectorSize;
+      writeable = fs->clusterSize;
       stream->rwPosInSector = 0;
     }
     address =
-        (stream->currentSector * fs->sectorSize) + stream->rwPosInSector;
+        (stream->currentSector * fs->clusterSize) + stream->rwPosInSector;
 
     DataLengthToWrite = len > writeable ? writeable : len;
-    if (fs->write_block_device(fs->addressStart + address, out,
-                               DataLengthToWrite)) {
+    if (writeChunk(fs, stream, address, out, DataLengthToWrite)) {
       fs->lastError = stream->lastError = UFAT_ERR_IO;
       UFAT_TRACE(("ufat_fwrite:UFAT_ERR_IO\r\n"));
       return UFAT_ERR_IO;
     }
-    stream->fh.crc = UFAT_CRC(out, DataLengthToWrite, stream->fh.crc);
     stream->position += DataLengthToWrite;
     stream->rwPosInSector += DataLengthToWrite;
     out += DataLengthToWrite;
     len -= DataLengthToWrite;
   }
+  /* The whole call goes to the driver at once */
+  if (ioSubmit(fs, 1)) {
+    fs->lastError = stream->lastError = UFAT_ERR_IO;
+    UFAT_TRACE(("ufat_fwrite:UFAT_ERR_IO\r\n"));
+    return UFAT_ERR_IO;
+  }
   return (size * count);
 }
 
+/* Move read data out of its staging buffer and check it */
+static void readDone(ufat_fs_t *fs, ufat_FILE *stream, uint8_t *dest,
+                     uint8_t *stage, uint32_t len) {
+  if (!stream->zeroCopy) {
+    memcpy(dest, stage, len);
+  }
+  if (stream->openFlags & UFAT_FILE_CRC_CHECK) {
+    stream->crcValidate = UFAT_FS_CRC(fs, dest, len, stream->crcValidate);
+  }
+}
+
 size_t ufat_fread(ufat_fs_t *fs, void *ptr, size_t size, size_t count,
                     ufat_FILE *stream) {
   UFAT_ASSERT(fs);
@@ -790,6 +2725,10 @@ size_t ufat_fread(ufat_fs_t *fs, void *ptr, size_t size, size_t count,
   uint32_t rawAdr;
   int32_t readCount = 0;
   uint8_t *in = (uint8_t *)ptr;
+  /* [batch, in) is queued or on the bus, staged at stage unless zeroCopy */
+  uint8_t *batch = in;
+  uint8_t *stage = fs->buff;
+  uint8_t *staged;
   uint32_t len = size * count;
   UFAT_TRACE(("ufat_fread(%i)\r\n", len));
   /* Protect fs state (mainly in test env) */
@@ -800,42 +2739,48 @@ size_t ufat_fread(ufat_fs_t *fs, void *ptr, size_t size, size_t count,
     return stream->lastError;
   }
   while (len) {
-    readable = fs->sectorSize - stream->rwPosInSector;
-    remaining = stream->fh.len - stream->position;
+    readable = fs->clusterSize - stream->rwPosInSector;
+    remaining = fileLength(&stream->fh) - stream->position;
     if (remaining == 0) {
       break;
     }
     if (readable == 0) {
-      next = fs->fat->sector[stream->currentSector].next;
+      next = entryAt(fs, stream->currentSector)->next;
       UFAT_TRACE(("ufat_fread:next sector[%i]\r\n", next));
       if (next == UFAT_EOF) {
         break;
       }
       stream->rwPosInSector = 0;
-      stream->currentSector = next;
-      readable = fs->sectorSize;
+      stream->currentSector = cowSector(stream, next);
+      readable = fs->clusterSize;
     }
 
     rlen = len > readable ? readable : len;
     rlen = rlen > remaining ? remaining : rlen;
-    rawAdr = (stream->currentSector * fs->sectorSize) + stream->rwPosInSector;
-    if (stream->zeroCopy) {
-      // Requires user implemented cache free operation
-      if (fs->read_block_device(fs->addressStart + rawAdr, in, rlen)) {
-        fs->lastError = stream->lastError = UFAT_ERR_IO;
-        UFAT_TRACE(("UFAT_ERR_IO\r\n"));
+    rawAdr = (stream->currentSector * fs->clusterSize) + stream->rwPosInSector;
+    // zeroCopy requires user implemented cache free operation
+    if (fs->submit_block_device) {
+      /* Chunk N+1 goes on the bus before chunk N is copied and checked */
+      staged = stream->zeroCopy ? in : nextStage(fs);
+      if (ioStart(fs, 0, rawAdr, staged, rlen)) {
+        stream->lastError = UFAT_ERR_IO;
         return 0;
       }
+      readDone(fs, stream, batch, stage, in - batch);
+      batch = in;
+      stage = staged;
     } else {
-      if (fs->read_block_device(fs->addressStart + rawAdr, fs->buff, rlen)) {
-        fs->lastError = stream->lastError = UFAT_ERR_IO;
-        UFAT_TRACE(("UFAT_ERR_IO\r\n"));
-        return 0;
+      if (fs->iovUsed == UFAT_IOV_COUNT ||
+          (!stream->zeroCopy && (in - batch) + rlen > UFAT_BUFF_SIZE(fs))) {
+        if (ioSubmit(fs, 0)) {
+          stream->lastError = UFAT_ERR_IO;
+          return 0;
+        }
+        readDone(fs, stream, batch, stage, in - batch);
+        batch = in;
       }
-      memcpy(in, fs->buff, rlen);
-    }
-    if (stream->openFlags & UFAT_FILE_CRC_CHECK) {
-      stream->crcValidate = UFAT_CRC(in, rlen, stream->crcValidate);
+      ioQueue(fs, 0, rawAdr, stream->zeroCopy ? in : fs->buff + (in - batch),
+              rlen);
     }
     stream->position += rlen;
     stream->rwPosInSector += rlen;
@@ -843,8 +2788,13 @@ size_t ufat_fread(ufat_fs_t *fs, void *ptr, size_t size, size_t count,
     len -= rlen;
     readCount += rlen;
   }
+  if (ioSubmit(fs, 0)) {
+    stream->lastError = UFAT_ERR_IO;
+    return 0;
+  }
+  readDone(fs, stream, batch, stage, in - batch);
   if (stream->openFlags & UFAT_FILE_CRC_CHECK &&
-      stream->position == stream->fh.len) {
+      stream->position == fileLength(&stream->fh)) {
     if (stream->crcValidate != stream->fh.crc) {
       return UFAT_ERR_FILECRC;
     }
@@ -868,20 +2818,21 @@ int ufat_remove(ufat_fs_t *fs, const char *filename) {
   if (ret == UFAT_ERR_FILE_NOT_FOUND) {
     return UFAT_OK;
   }
+  if (ret != UFAT_OK) {
+    return ret;
+  }
 
-  limit = fs->sectors;
+  dirRemove(fs, nameHash(filename), sector);
+  limit = fs->clusters;
   current = sector;
-  next = fs->fat->sector[current].next;
+  next = entryAt(fs, current)->next;
   UFAT_TRACE(("ufat_remove:DELETE:%i.%i.", current, next));
   while (1) {
-    fs->fat->sector[current].available = 1;
-    fs->fat->sector[current].written = 0;
-    fs->fat->sector[current].sof = 0;
-    fs->fat->sector[current].next = UFAT_MAX_SECTORS;
+    freeSector(fs, current);
     if (next == UFAT_EOF) {
       break;
     }
-    if (next < UFAT_TABLE_COUNT || (next >= fs->sectors && next != UFAT_EOF)) {
+    if (next < fs->firstCluster || (next >= fs->clusters && next != UFAT_EOF)) {
       UFAT_ERROR(("Corrupt file system next = %i\r\n", next));
       UFAT_TRACE(("UFAT_ERR_CORRUPT\r\n", next));
       fs->lastError = UFAT_ERR_CORRUPT;
@@ -889,7 +2840,7 @@ int ufat_remove(ufat_fs_t *fs, const char *filename) {
       goto finalize;
     }
     current = next;
-    next = fs->fat->sector[next].next;
+    next = entryAt(fs, next)->next;
     if (--limit < 1) {
       UFAT_TRACE(("UFAT_ERR_CORRUPT limit\r\n"));
       fs->lastError = UFAT_ERR_CORRUPT;
@@ -938,7 +2889,128 @@ size_t ufat_flength(ufat_FILE *f) {
   if (f == NULL) {
     return 0;
   }
-  return f->fh.len;
+  return fileLength(&f->fh);
+}
+
+int ufat_fsizehint(ufat_FILE *f, uint32_t size) {
+  UFAT_ASSERT(f);
+  if (!(f->openFlags & UFAT_FLAG_WRITE)) {
+    return UFAT_ERR_UNSUPPORTED;
+  }
+  f->sizeHint = size;
+  return UFAT_OK;
+}
+
+/* Map for ufat_fseek, must be pre-allocated to
+ * (sizeof(ufat_link_t) * entries), longer files walk the chain from the last
+ * mapped sector */
+int ufat_fsetmap(ufat_FILE *f, ufat_link_t *map, uint32_t entries) {
+  UFAT_ASSERT(f);
+  if (!(f->openFlags & UFAT_FLAG_READ)) {
+    return UFAT_ERR_UNSUPPORTED;
+  }
+  f->sectorMap = map;
+  f->mapEntries = map ? entries : 0;
+  f->mapCount = 0;
+  return UFAT_OK;
+}
+
+/* Sector at chain position index, through the map when it reaches */
+static int32_t chainSector(ufat_fs_t *fs, ufat_FILE *f, uint32_t index) {
+  uint32_t at = 0;
+  uint32_t sector = f->startSector;
+  if (f->mapEntries && f->mapCount == 0) {
+    /* Built once, the chain of a read stream does not change */
+    f->sectorMap[f->mapCount++] = sector;
+    while (f->mapCount < f->mapEntries &&
+           entryAt(fs, sector)->next != UFAT_EOF) {
+      sector = entryAt(fs, sector)->next;
+      if (sector < fs->firstCluster || sector >= fs->clusters) {
+        return UFAT_ERR_CORRUPT;
+      }
+      f->sectorMap[f->mapCount++] = sector;
+    }
+  }
+  if (f->mapCount) {
+    at = index < f->mapCount ? index : f->mapCount - 1;
+    sector = f->sectorMap[at];
+  }
+  for (; at < index; at++) {
+    sector = entryAt(fs, sector)->next;
+    if (sector < fs->firstCluster || sector >= fs->clusters) {
+      return UFAT_ERR_CORRUPT;
+    }
+  }
+  return sector;
+}
+
+int ufat_fseek(ufat_fs_t *fs, ufat_FILE *f, int32_t offset, int origin) {
+  int64_t pos;
+  int32_t sector;
+  uint32_t chainPos, index;
+  UFAT_ASSERT(fs);
+  UFAT_ASSERT(fs->volumeMounted);
+  UFAT_ASSERT(f);
+  if (!f->opened) {
+    return f->lastError;
+  }
+  if (!(f->openFlags & UFAT_FLAG_READ)) {
+    return UFAT_ERR_UNSUPPORTED;
+  }
+  switch (origin) {
+  case UFAT_SEEK_SET:
+    pos = offset;
+    break;
+  case UFAT_SEEK_CUR:
+    pos = (int64_t)f->position + offset;
+    break;
+  case UFAT_SEEK_END:
+    pos = (int64_t)fileLength(&f->fh) + offset;
+    break;
+  default:
+    return UFAT_ERR_UNSUPPORTED;
+  }
+  if (pos < 0 || pos > fileLength(&f->fh)) {
+    return UFAT_ERR_RANGE;
+  }
+  /* Left at the end of the sector holding the byte before, as a read
+   * up to pos would */
+  chainPos = (uint32_t)pos + sizeof(ufat_file_t);
+  index = (chainPos - 1) / fs->clusterSize;
+  sector = chainSector(fs, f, index);
+  if (sector < 0) {
+    return f->lastError = sector;
+  }
+  f->currentSector = cowSector(f, sector);
+  f->rwPosInSector = chainPos - (index * fs->clusterSize);
+  f->position = (uint32_t)pos;
+  /* The file CRC only checks a sequential read */
+  f->openFlags &= ~UFAT_FILE_CRC_CHECK;
+  return UFAT_OK;
+}
+
+int32_t ufat_ftell(ufat_FILE *f) {
+  UFAT_ASSERT(f);
+  return f->position;
+}
+
+/* Read at offset, the stream position stays put */
+size_t ufat_pread(ufat_fs_t *fs, ufat_FILE *f, uint32_t offset, void *ptr,
+                  size_t len) {
+  ufat_FILE at;
+  size_t ret;
+  UFAT_ASSERT(f);
+  if (f->mapEntries && f->mapCount == 0 && chainSector(fs, f, 0) < 0) {
+    return 0;
+  }
+  at = *f;
+  if (ufat_fseek(fs, &at, offset, UFAT_SEEK_SET)) {
+    f->lastError = at.lastError;
+    return 0;
+  }
+  ret = ufat_fread(fs, ptr, 1, len, &at);
+  f->lastError = at.lastError;
+  return ret;
 }
 
 const char *ufat_errstr(int err) {
@@ -966,6 +3038,10 @@ const char *ufat_errstr(int err) {
     return "NULL";
   case UFAT_ERR_NAME_LEN:
     return "NAME_LEN";
+  case UFAT_ERR_RANGE:
+    return "RANGE";
+  case UFAT_ERR_COW_LIMIT:
+    return "COW LIMIT";
   default:
     snprintf(errstr, sizeof(errstr), "%i", err);
     return (const char *)errstr;
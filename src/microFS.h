@@ -30,9 +30,45 @@
 
 #define UFAT_VERSION "1.0"
 
+#ifdef UFAT_WIDE_TABLE
+/* 32 bit table entries for volumes past 4095 sectors, the table takes twice
+ * the space and volumes do not mount across the two layouts */
+#define UFAT_MAX_SECTORS (0x0FFFFFFF)
+#define UFAT_NEXT_BITS 28
+typedef uint32_t ufat_link_t;
+#else
 #define UFAT_MAX_SECTORS (0xFFF)
+#define UFAT_NEXT_BITS 12
+typedef uint16_t ufat_link_t;
+#endif
 #define UFAT_MAX_NAMELEN (18)
 #define UFAT_TABLE_COUNT 2
+#ifndef UFAT_DIRTY_WORDS
+/* Dirty table sector bits, larger tables track groups of sectors per bit */
+#define UFAT_DIRTY_WORDS 4
+#endif
+#ifndef UFAT_COW_SECTORS
+/* Sectors one "r+" stream can modify between ufat_fopen and ufat_fclose */
+#define UFAT_COW_SECTORS 8
+#endif
+#ifndef UFAT_IOV_COUNT
+/* Segments per vectored driver submission */
+#define UFAT_IOV_COUNT 8
+#endif
+#ifndef UFAT_PAGE_SLOTS
+/* Most page slots of a paged table, at most 32 */
+#define UFAT_PAGE_SLOTS 8
+#endif
+
+/* Mount options */
+#define UFAT_OPT_CONTIGUOUS (1 << 0) /* Reserve runs of sectors per stream */
+#define UFAT_OPT_WRITE_BACK (1 << 1) /* Group table commits, see ufat_sync */
+
+/* Format features, stored in the table header */
+#define UFAT_FEATURE_DIR_TABLE (1 << 0) /* Hashed name table in each copy */
+#define UFAT_FEATURE_SECTOR_CRC (1 << 1) /* CRC per table sector */
+#define UFAT_FEATURE_PING_PONG (1 << 2) /* Commits alternate table copies */
+#define UFAT_FEATURE_LARGE_FILES (1 << 3) /* 32 bit lengths, names one shorter */
 
 enum {
   UFAT_OK = 0,
@@ -45,23 +81,76 @@ enum {
   UFAT_ERR_UNSUPPORTED,
   UFAT_ERR_FILECRC,
   UFAT_ERR_NULL,
-  UFAT_ERR_NAME_LEN
+  UFAT_ERR_NAME_LEN,
+  UFAT_ERR_RANGE,
+  UFAT_ERR_COW_LIMIT /* "r+" stream changed UFAT_COW_SECTORS, see ufat_fopen */
 };
 
+/* ufat_fseek origins */
+#define UFAT_SEEK_SET 0
+#define UFAT_SEEK_CUR 1
+#define UFAT_SEEK_END 2
+
 typedef struct {
-  uint16_t next : 12;
+  ufat_link_t next : UFAT_NEXT_BITS;
   /* Start of file flag */
-  uint16_t sof : 1;
-  uint16_t available : 1;
+  ufat_link_t sof : 1;
+  ufat_link_t available : 1;
   /* commited */
-  uint16_t written : 1;
+  ufat_link_t written : 1;
+  /* Freed in RAM while the media table may still use it, never stored */
+  ufat_link_t pending : 1;
 } ufat_sector_t;
 
+/* Overlays the reserved entries of the table sectors, zero on volumes
+ * formatted without features */
+typedef struct {
+  uint32_t tableCrc;
+  uint16_t magic;
+  uint16_t features;
+  uint16_t dirSlots;
+  uint16_t state;
+  /* UFAT_FEATURE_PING_PONG, the newest valid copy wins at mount */
+  uint32_t generation;
+} ufat_table_header_t;
+
+/* Name table slot, sector 0 marks an empty slot */
+typedef struct {
+  uint32_t hash;
+  uint32_t sector;
+} ufat_dir_slot_t;
+
 typedef union {
   uint32_t tableCrc;
+  ufat_table_header_t header;
   ufat_sector_t sector[0];
 } ufat_table_t; /* must equal sector size */
 
+typedef struct {
+  uint32_t crc;
+  uint32_t timeStamp;
+  uint16_t len;
+  char name[UFAT_MAX_NAMELEN - 2];
+  /* Top of len with UFAT_FEATURE_LARGE_FILES, other volumes keep it zero as
+   * the terminator of a full length name */
+  uint16_t lenHigh;
+} ufat_file_t;
+
+typedef struct {
+  uint32_t hash;
+  uint32_t sector;
+  /* fh is read on first use when the index came from the name table */
+  uint32_t loaded;
+  ufat_file_t fh;
+} ufat_dir_entry_t;
+
+/* One segment of a vectored driver call */
+typedef struct {
+  uint32_t address;
+  uint8_t *data;
+  uint32_t len;
+} ufat_iovec_t;
+
 typedef struct {
   /* Physical address of media */
   const uint32_t addressStart;
@@ -71,28 +160,105 @@ typedef struct {
   const uint32_t sectorSize;
   /* Number of sectors per table */
   const uint32_t tableSectors;
+  /* Table entries track clusters of 2^clusterShift sectors, set before
+   * ufat_format and kept like the rest of the geometry. Files grow a
+   * cluster at a time, so the table and chain walks shrink for some slack */
+  const uint32_t clusterShift;
   /* buff is used for all IO, so if driver uses DMA, allocate accordingly 
-   * Must be pre-allocated to (sector bytes * tableSectors) */
+   * Must be pre-allocated to (sector bytes * tableSectors), cluster bytes
+   * with a paged table */
   uint8_t* buff;
   /* fat is used to store the working copy of the table
-   * Must be pre-allocated to (sector bytes * tableSectors) */
+   * Must be pre-allocated to (sector bytes * tableSectors), NULL pages it */
   ufat_table_t *fat;
+  /* Paged table, table sectors are loaded into pageSlots slots as they are
+   * used and the least recently used one is written back for the next. Only
+   * volumes formatted with UFAT_FEATURE_SECTOR_CRC, 2 to UFAT_PAGE_SLOTS
+   * slots. Must be pre-allocated to (sector bytes * pageSlots) */
+  uint8_t *pages;
+  const uint32_t pageSlots;
+  /* Optional directory index, built at mount so name lookups need no IO
+   * Must be pre-allocated to (sizeof(ufat_dir_entry_t) * dirEntries) */
+  ufat_dir_entry_t *dir;
+  const uint32_t dirEntries;
+  /* Optional free sector bitmap, built at mount and used for allocation
+   * Must be pre-allocated to (sizeof(uint32_t) * ((sectors + 31) / 32)) */
+  uint32_t *freeMap;
+  /* UFAT_OPT_x */
+  const uint32_t options;
+  /* ufat_format options, UFAT_FEATURE_x */
+  const uint32_t formatFeatures;
+  /* Name table slots per copy with UFAT_FEATURE_DIR_TABLE, the table
+   * sectors must hold (sizeof(ufat_dir_slot_t) * dirSlots) past the entries */
+  const uint32_t dirSlots;
+  /* UFAT_OPT_WRITE_BACK flushes after commitOps deferred commits, or once
+   * clock() passes commitTicks after the first one, 0 / NULL disables */
+  const uint32_t commitOps;
+  const uint32_t commitTicks;
+  uint32_t (*clock)(void);
   uint32_t (*read_block_device)(uint32_t address, uint8_t *data, uint32_t len);
   uint32_t (*write_block_device)(uint32_t address, uint8_t *data,
                                  uint32_t length);
+  /* Optional, transfer the segments in order as one submission, NULL makes
+   * a read/write_block_device call per segment */
+  uint32_t (*readv_block_device)(const ufat_iovec_t *iov, uint32_t count);
+  uint32_t (*writev_block_device)(const ufat_iovec_t *iov, uint32_t count);
+  /* Optional asynchronous file data transfers, submit starts one and
+   * returns, complete waits for it and returns its status. Only one is in
+   * flight and no other driver call is made until it completes. Data goes
+   * through the two stage buffers, each pre-allocated to cluster bytes */
+  uint32_t (*submit_block_device)(uint32_t address, uint8_t *data,
+                                  uint32_t len, uint32_t write);
+  uint32_t (*complete_block_device)(void);
+  uint8_t *stage[2];
   /* Internal use */
   uint32_t volumeMounted;
   int lastError;
+  uint32_t features;
+  /* Allocation unit, sectorSize << clusterShift, the units in media and
+   * the first one past the table copies */
+  uint32_t clusterSize;
+  uint32_t clusters;
+  uint32_t firstCluster;
+  /* Bytes of each table copy in use, covered by tableCrc */
+  uint32_t tableBytes;
+  /* Table sectors changed since the last commit */
+  uint32_t dirty[UFAT_DIRTY_WORDS];
+  uint32_t dirtyShift;
+  /* Copy holding the newest table, and the sectors the other copy lacks */
+  uint32_t tableIndex;
+  uint32_t stale[UFAT_DIRTY_WORDS];
+  /* Table sector in each page slot, its last use and the slots changed
+   * since, and the dirty groups evictions moved to the other copy */
+  uint32_t pageTag[UFAT_PAGE_SLOTS];
+  uint32_t pageUse[UFAT_PAGE_SLOTS];
+  uint32_t pageDirty;
+  uint32_t pageClock;
+  uint32_t pageLast;
+  uint32_t spilled[UFAT_DIRTY_WORDS];
+  /* UFAT_CRC may fold with carry-less multiplies, from CPUID at mount */
+  uint32_t crcFold;
+  /* ufat_begin() active, commits wait for ufat_commit() */
+  uint32_t transaction;
+  uint32_t pendingCount;
+  /* Commits waiting for a UFAT_OPT_WRITE_BACK flush */
+  uint32_t deferredOps;
+  uint32_t deadline;
+  /* Media copies carry the ufat_unmount() marker */
+  uint32_t clean;
+  uint32_t freeCount;
+  uint32_t dirCount;
+  /* Index holds every file, a miss means the file does not exist */
+  uint32_t dirValid;
+  /* Segments queued for the next driver submission */
+  ufat_iovec_t iov[UFAT_IOV_COUNT];
+  uint32_t iovUsed;
+  /* Next stage buffer, and a submit waiting for complete */
+  uint32_t stageNext;
+  uint32_t inFlight;
 
 } ufat_fs_t;
 
-typedef struct {
-  uint32_t crc;
-  uint32_t timeStamp;
-  uint16_t len;
-  char name[UFAT_MAX_NAMELEN];
-} ufat_file_t;
-
 typedef struct {
   uint32_t startSector;
   uint32_t position;
@@ -106,10 +272,37 @@ typedef struct {
   uint32_t opened : 1;
   uint32_t crcValidate;
   int lastError;
+  /* UFAT_OPT_CONTIGUOUS reservation, [reserveNext, reserveEnd) */
+  uint32_t sizeHint;
+  uint32_t reserveNext;
+  uint32_t reserveEnd;
+  /* Optional ufat_fseek map of chain position to sector, see ufat_fsetmap,
+   * built on the first seek. mapCount entries are filled */
+  ufat_link_t *sectorMap;
+  uint32_t mapEntries;
+  uint32_t mapCount;
+  /* "a" mode, the old tail and its first new sector, linked at close */
+  uint32_t appendTail;
+  uint32_t appendLink;
+  /* "a" and "r+", the sector the head is copied to with the new header */
+  uint32_t headCopy;
+  /* "r+" copies of modified sectors, spliced into the chain at close */
+  ufat_link_t cowOld[UFAT_COW_SECTORS];
+  ufat_link_t cowNew[UFAT_COW_SECTORS];
+  uint32_t cowCount;
 } ufat_FILE;
 
 int ufat_mount(ufat_fs_t *fs);
+int ufat_unmount(ufat_fs_t *fs);
 int ufat_format(ufat_fs_t *fs);
+/* mode "r", "rb", "w", "wb", "a", "ab", "r+" or "rb+". "r+" overwrites in
+ * place, "a" extends. An "r+" stream copies each sector it changes, at most
+ * UFAT_COW_SECTORS sectors in total from ufat_fopen to ufat_fclose. Once they
+ * are used, a write to any other sector fails with UFAT_ERR_COW_LIMIT however
+ * small, and ufat_fclose returns it and leaves the file as it was. Larger
+ * updates close and reopen between batches. A "z" suffix (e.g. "rz") hands the caller's
+ * buffer to the driver instead of fs->buff or a stage buffer, so it must suit
+ * the driver (DMA reach, cache maintenance) */
 int ufat_fopen(ufat_fs_t *fs, const char *filename, const char *mode,
                  ufat_FILE *file);
 int ufat_fclose(ufat_fs_t *fs, ufat_FILE *stream);
@@ -119,10 +312,29 @@ size_t ufat_fread(ufat_fs_t *fs, void *ptr, size_t size, size_t count,
                     ufat_FILE *stream);
 int ufat_remove(ufat_fs_t *fs, const char *filename);
 size_t ufat_flength(ufat_FILE *file);
+int ufat_fsizehint(ufat_FILE *file, uint32_t size);
+int ufat_fsetmap(ufat_FILE *file, ufat_link_t *map, uint32_t entries);
+/* O(1) within the ufat_fsetmap map. Without a map, or past its last entry,
+ * seek walks the table chain from the head or the last mapped sector, O(n)
+ * in the offset. A map of (ufat_flength(file) + sizeof(ufat_file_t) +
+ * fs->clusterSize - 1) / fs->clusterSize entries covers the whole file */
+int ufat_fseek(ufat_fs_t *fs, ufat_FILE *file, int32_t offset, int origin);
+int32_t ufat_ftell(ufat_FILE *file);
+size_t ufat_pread(ufat_fs_t *fs, ufat_FILE *file, uint32_t offset, void *ptr,
+                  size_t len);
 int ufat_fsinfo(ufat_fs_t *fs, char *buff, int32_t maxLen);
+uint32_t ufat_freecount(ufat_fs_t *fs);
+int ufat_begin(ufat_fs_t *fs);
+int ufat_commit(ufat_fs_t *fs);
+int ufat_abort(ufat_fs_t *fs);
+int ufat_sync(ufat_fs_t *fs);
 int ufat_exists(ufat_fs_t *fs, const char *filename);
 int ufat_ferror(ufat_FILE *file);
 int ufat_errno(ufat_fs_t *fs);
 const char *ufat_errstr(int err);
+uint32_t ufat_crc32_combine(uint32_t crcA, uint32_t crcB, uint32_t lenB);
+uint32_t ufat_crc32_patch(uint32_t crc, const void *oldData,
+                          const void *newData, uint32_t len,
+                          uint32_t tailLen);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,178 @@
+#include <stdlib.h>
+#include "unity.h"
+#include "unity_fixture.h"
+#include "microFS.h"
+#include "microFSconfig.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define BENCH_NOW() __rdtsc()
+#define BENCH_UNIT "cycle"
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_NOW() __rdtsc()
+#define BENCH_UNIT "cycle"
+#else
+#define BENCH_NOW() clock()
+#define BENCH_UNIT "clock tick"
+#endif
+
+#define BENCH_BYTES 0x10000
+#define BENCH_ROUNDS 64
+
+/* Built under TEST_DEV whatever UFAT_CRC_KERNEL selects */
+uint32_t crc32_nibble(void *buf, int len, uint32_t Seed);
+uint32_t crc32_byte(void *buf, int len, uint32_t Seed);
+uint32_t crc32_slice8(void *buf, int len, uint32_t Seed);
+uint32_t crc32_slice16(void *buf, int len, uint32_t Seed);
+
+#if !defined(UFAT_CRC_NO_CLMUL) && (defined(__x86_64__) || defined(_M_X64))
+#define CRC_CLMUL
+int crc32_clmul_supported(void);
+uint32_t crc32_clmul(void *buf, int len, uint32_t Seed);
+#endif
+
+typedef uint32_t (*crcKernel_t)(void *buf, int len, uint32_t Seed);
+
+static const struct {
+  const char *name;
+  crcKernel_t kernel;
+} kernels[] = {{"nibble", crc32_nibble},
+               {"byte", crc32_byte},
+               {"slice8", crc32_slice8},
+               {"slice16", crc32_slice16},
+#ifdef CRC_CLMUL
+               {"clmul", crc32_clmul}
+#endif
+};
+
+static int kernelAvailable(uint32_t k) {
+#ifdef CRC_CLMUL
+  if (kernels[k].kernel == crc32_clmul) {
+    return crc32_clmul_supported();
+  }
+#endif
+  (void)k;
+  return 1;
+}
+
+#define KERNEL_COUNT (sizeof(kernels) / sizeof(kernels[0]))
+
+static uint8_t *data;
+
+TEST_GROUP(CRC);
+
+TEST_SETUP(CRC) {
+  uint32_t i;
+  data = malloc(BENCH_BYTES + 16);
+  srand((unsigned)time(NULL));
+  for (i = 0; i < BENCH_BYTES + 16; i++) {
+    data[i] = (uint8_t)rand();
+  }
+}
+
+TEST_TEAR_DOWN(CRC) {
+  free(data);
+  data = NULL;
+}
+
+TEST(CRC, KernelsMatch) {
+  uint32_t k, offset, len, expect;
+  char check[] = "123456789";
+  /* CRC-32/MPEG-2 check value, no final complement */
+  TEST_ASSERT_EQUAL_HEX32(0x0376E6E7,
+                          crc32_byte(check, strlen(check), 0xFFFFFFFF));
+  for (offset = 0; offset < 16; offset++) {
+    for (len = 0; len < 300; len++) {
+      expect = crc32_byte(&data[offset], len, 0xFFFFFFFF);
+      for (k = 0; k < KERNEL_COUNT; k++) {
+        if (!kernelAvailable(k)) {
+          continue;
+        }
+        TEST_ASSERT_EQUAL_HEX32_MESSAGE(
+            expect, kernels[k].kernel(&data[offset], len, 0xFFFFFFFF),
+            kernels[k].name);
+      }
+    }
+  }
+  /* Chained calls, as the file CRC is built per write */
+  expect = crc32_byte(data, BENCH_BYTES, 0xFFFFFFFF);
+  for (k = 0; k < KERNEL_COUNT; k++) {
+    if (!kernelAvailable(k)) {
+      continue;
+    }
+    TEST_ASSERT_EQUAL_HEX32_MESSAGE(
+        expect,
+        kernels[k].kernel(&data[1001], BENCH_BYTES - 1001,
+                          kernels[k].kernel(data, 1001, 0xFFFFFFFF)),
+        kernels[k].name);
+  }
+}
+
+TEST(CRC, ClmulMatchesTable) {
+#ifdef CRC_CLMUL
+  uint32_t i, offset, len, seed;
+  if (!crc32_clmul_supported()) {
+    TEST_IGNORE_MESSAGE("No PCLMULQDQ on this CPU");
+  }
+  for (i = 0; i < 2000; i++) {
+    offset = rand() % 16;
+    len = i < 1000 ? i : (uint32_t)rand() % BENCH_BYTES;
+    seed = i & 1 ? 0xFFFFFFFF : ((uint32_t)rand() << 16) ^ rand();
+    TEST_ASSERT_EQUAL_HEX32(crc32_byte(&data[offset], len, seed),
+                            crc32_clmul(&data[offset], len, seed));
+  }
+#else
+  TEST_IGNORE_MESSAGE("No PCLMULQDQ build");
+#endif
+}
+
+TEST(CRC, CombineAndPatch) {
+  uint32_t i, split, len, crcA, crcB, off, n;
+  uint8_t patch[64];
+  for (i = 0; i < 200; i++) {
+    len = (uint32_t)rand() % BENCH_BYTES;
+    split = len ? (uint32_t)rand() % len : 0;
+    crcA = crc32_byte(data, split, 0xFFFFFFFF);
+    crcB = crc32_byte(&data[split], len - split, 0xFFFFFFFF);
+    TEST_ASSERT_EQUAL_HEX32(crc32_byte(data, len, 0xFFFFFFFF),
+                            ufat_crc32_combine(crcA, crcB, len - split));
+  }
+  for (i = 0; i < 200; i++) {
+    len = 1 + (uint32_t)rand() % (BENCH_BYTES - 1);
+    n = 1 + (uint32_t)rand() % sizeof(patch);
+    n = n > len ? len : n;
+    off = (uint32_t)rand() % (len - n + 1);
+    crcA = crc32_byte(data, len, 0xFFFFFFFF);
+    for (split = 0; split < n; split++) {
+      patch[split] = (uint8_t)rand();
+    }
+    crcA = ufat_crc32_patch(crcA, &data[off], patch, n, len - off - n);
+    memcpy(&data[off], patch, n);
+    TEST_ASSERT_EQUAL_HEX32(crc32_byte(data, len, 0xFFFFFFFF), crcA);
+  }
+}
+
+TEST(CRC, KernelBenchmark) {
+  uint32_t k, i;
+  uint64_t start, ticks;
+  volatile uint32_t sink = 0;
+  for (k = 0; k < KERNEL_COUNT; k++) {
+    if (!kernelAvailable(k)) {
+      continue;
+    }
+    sink ^= kernels[k].kernel(data, BENCH_BYTES, 0xFFFFFFFF);
+    start = BENCH_NOW();
+    for (i = 0; i < BENCH_ROUNDS; i++) {
+      sink ^= kernels[k].kernel(data, BENCH_BYTES, sink);
+    }
+    ticks = BENCH_NOW() - start;
+    printf("crc32_%-8s %8.3f bytes/%s\r\n", kernels[k].name,
+           ticks ? (double)BENCH_BYTES * BENCH_ROUNDS / (double)ticks : 0.0,
+           BENCH_UNIT);
+  }
+}
@@ -18,8 +18,42 @@ int rand_s(unsigned int *randomValue);
 #define FAKE_PROM_SECTOR_SIZE 64
 #define FAKE_PROM_TABLE_SECTORS                                                \
   ((FAKE_PROM_SIZE / FAKE_PROM_SECTOR_SIZE) / FAKE_PROM_SECTOR_SIZE)
+/* Table copy with room for the format features */
+#ifdef UFAT_WIDE_TABLE
+#define FEATURE_TABLE_SECTORS 11
+#else
+#define FEATURE_TABLE_SECTORS 7
+#endif
+#define FEATURE_DIR_SLOTS 16
+/* Room for files past the 64 KB a 16 bit length holds */
+#define LARGE_PROM_SECTOR_SIZE 512
+#define LARGE_PROM_SECTORS 4000
+#define LARGE_TABLE_SECTORS                                                    \
+  ((LARGE_PROM_SECTORS * sizeof(ufat_sector_t) + LARGE_PROM_SECTOR_SIZE - 1) / \
+   LARGE_PROM_SECTOR_SIZE)
+/* Table past the dirty bits, so evictions move whole groups of sectors */
+#define PAGED_PROM_SECTORS 4000
+#define PAGED_PAYLOAD                                                          \
+  (PAGED_PROM_SECTORS * sizeof(ufat_sector_t) +                                \
+   FEATURE_DIR_SLOTS * sizeof(ufat_dir_slot_t))
+#define PAGED_TABLE_SECTORS                                                    \
+  ((PAGED_PAYLOAD + 4 * ((PAGED_PAYLOAD + FAKE_PROM_SECTOR_SIZE - 1) /         \
+                         FAKE_PROM_SECTOR_SIZE) +                              \
+    FAKE_PROM_SECTOR_SIZE - 1) /                                               \
+   FAKE_PROM_SECTOR_SIZE)
+#define PAGED_SLOTS 3
+#ifdef UFAT_WIDE_TABLE
+/* Past the 0xFFFF sectors a 16 bit link could hold */
+#define WIDE_PROM_SECTORS 0x10400
+#define PROM_SIZE (WIDE_PROM_SECTORS * FAKE_PROM_SECTOR_SIZE)
+#else
+#define PROM_SIZE (LARGE_PROM_SECTORS * LARGE_PROM_SECTOR_SIZE)
+#endif
 
-static uint8_t block[FAKE_PROM_SIZE];
+static uint8_t block[PROM_SIZE];
+
+/* test, validate and compare, fillupTest writes up to 0xFFFF bytes of test */
+#define TEST_BUFFER_SIZE 0x10000
 
 #define TAKE_DOWN_READ (1UL << 0)
 #define TAKE_DOWN_WRITE (1UL << 1)
@@ -38,13 +72,16 @@ uint32_t POWER_CYCLE_COUNT = 499999;
 uint32_t takeDownPeriod = 0;
 uint32_t takeDownTest = 0;
 uint32_t takeDownFlags = 0;
+uint32_t readCount = 0;
+uint32_t writeBytes = 0;
 uint8_t *test;
 uint8_t *validate;
 uint8_t *compare;
 
 uint32_t read_block_device(uint32_t address, uint8_t *data, uint32_t len) {
-  TEST_ASSERT_MESSAGE(address + len <= FAKE_PROM_SIZE,
+  TEST_ASSERT_MESSAGE(address + len <= PROM_SIZE,
                       "Out of range address at read_block_device");
+  readCount++;
   if (takeDownTest && (takeDownFlags & TAKE_DOWN_READ)) {
 
     if (takeDownPeriod != 0) {
@@ -60,8 +97,9 @@ uint32_t read_block_device(uint32_t address, uint8_t *data, uint32_t len) {
 
 uint32_t write_block_page(uint32_t address, uint8_t *data, uint32_t length) {
   uint32_t i;
-  TEST_ASSERT_MESSAGE(address + length <= FAKE_PROM_SIZE,
+  TEST_ASSERT_MESSAGE(address + length <= PROM_SIZE,
                       "Out of range address at read_block_device");
+  writeBytes += length;
   if (takeDownTest && (takeDownFlags & TAKE_DOWN_WRITE)) {
 
     if (takeDownPeriod != 0) {
@@ -87,6 +125,88 @@ uint32_t write_block_page(uint32_t address, uint8_t *data, uint32_t length) {
   return 0;
 }
 
+uint32_t vectorCalls = 0;
+uint32_t vectorSegments = 0;
+
+/* Vectored calls made of the single ones, so take downs still apply */
+static uint32_t readv_block_device(const ufat_iovec_t *iov, uint32_t count) {
+  uint32_t i;
+  vectorCalls++;
+  vectorSegments += count;
+  for (i = 0; i < count; i++) {
+    if (read_block_device(iov[i].address, iov[i].data, iov[i].len)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static uint32_t writev_block_device(const ufat_iovec_t *iov, uint32_t count) {
+  uint32_t i;
+  vectorCalls++;
+  vectorSegments += count;
+  for (i = 0; i < count; i++) {
+    if (write_block_page(iov[i].address, iov[i].data, iov[i].len)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Simulated asynchronous driver, a transfer lands on the media only when
+ * it completes and its buffer must not change while it is on the bus */
+static struct {
+  uint32_t busy;
+  uint32_t address;
+  uint8_t *data;
+  uint32_t len;
+  uint32_t write;
+  uint8_t copy[FAKE_PROM_SECTOR_SIZE];
+} bus;
+uint32_t asyncCalls = 0;
+
+static uint32_t submit_block_device(uint32_t address, uint8_t *data,
+                                    uint32_t len, uint32_t write) {
+  TEST_ASSERT_MESSAGE(!bus.busy, "Submit with a transfer in flight");
+  TEST_ASSERT_MESSAGE(len <= sizeof(bus.copy), "Transfer over a sector");
+  asyncCalls++;
+  bus.busy = 1;
+  bus.address = address;
+  bus.data = data;
+  bus.len = len;
+  bus.write = write;
+  if (write) {
+    memcpy(bus.copy, data, len);
+  } else {
+    /* Anything looking before complete sees junk */
+    memset(data, 0xA5, len);
+  }
+  return 0;
+}
+
+static uint32_t complete_block_device(void) {
+  TEST_ASSERT_MESSAGE(bus.busy, "Complete without a transfer");
+  bus.busy = 0;
+  if (bus.write) {
+    TEST_ASSERT_MESSAGE(memcmp(bus.copy, bus.data, bus.len) == 0,
+                        "Stage buffer changed while on the bus");
+    return write_block_page(bus.address, bus.data, bus.len);
+  }
+  return read_block_device(bus.address, bus.data, bus.len);
+}
+
+static uint32_t idle_read_block_device(uint32_t address, uint8_t *data,
+                                       uint32_t len) {
+  TEST_ASSERT_MESSAGE(!bus.busy, "Read with a transfer in flight");
+  return read_block_device(address, data, len);
+}
+
+static uint32_t idle_write_block_device(uint32_t address, uint8_t *data,
+                                        uint32_t len) {
+  TEST_ASSERT_MESSAGE(!bus.busy, "Write with a transfer in flight");
+  return write_block_page(address, data, len);
+}
+
 #ifdef TRACE_ENABLE
 int traceHandler(const char *format, ...) {
   char buf[1024]; // Not thread safe
@@ -138,22 +258,165 @@ ufat_fs_t fs1 = {.addressStart = 0,
                  .sectors = FAKE_PROM_SIZE / FAKE_PROM_SECTOR_SIZE,
                  .sectorSize = FAKE_PROM_SECTOR_SIZE,
                  .tableSectors = (FAKE_PROM_SIZE / FAKE_PROM_SECTOR_SIZE) *
-                                 UFAT_TABLE_COUNT / FAKE_PROM_SECTOR_SIZE,
+                                 sizeof(ufat_sector_t) / FAKE_PROM_SECTOR_SIZE,
+                 .dirEntries = 16,
+                 .write_block_device = write_block_page,
+                 .read_block_device = read_block_device};
+
+uint32_t clockTicks = 0;
+
+static uint32_t testClock(void) { return clockTicks; }
+
+/* fs1 geometry with deferred table commits */
+ufat_fs_t fs3 = {.addressStart = 0,
+                 .sectors = FAKE_PROM_SIZE / FAKE_PROM_SECTOR_SIZE,
+                 .sectorSize = FAKE_PROM_SECTOR_SIZE,
+                 .tableSectors = (FAKE_PROM_SIZE / FAKE_PROM_SECTOR_SIZE) *
+                                 sizeof(ufat_sector_t) / FAKE_PROM_SECTOR_SIZE,
+                 .options = UFAT_OPT_WRITE_BACK,
+                 .commitOps = 4,
+                 .commitTicks = 100,
+                 .clock = testClock,
+                 .write_block_device = write_block_page,
+                 .read_block_device = read_block_device};
+
+/* fs1 geometry on the asynchronous driver */
+ufat_fs_t fs4 = {.addressStart = 0,
+                 .sectors = FAKE_PROM_SIZE / FAKE_PROM_SECTOR_SIZE,
+                 .sectorSize = FAKE_PROM_SECTOR_SIZE,
+                 .tableSectors = (FAKE_PROM_SIZE / FAKE_PROM_SECTOR_SIZE) *
+                                 sizeof(ufat_sector_t) / FAKE_PROM_SECTOR_SIZE,
+                 .write_block_device = idle_write_block_device,
+                 .read_block_device = idle_read_block_device,
+                 .submit_block_device = submit_block_device,
+                 .complete_block_device = complete_block_device};
+
+ufat_fs_t fs2 = {.addressStart = 0,
+                 .sectors = FAKE_PROM_SIZE / FAKE_PROM_SECTOR_SIZE,
+                 .sectorSize = FAKE_PROM_SECTOR_SIZE,
+                 .tableSectors = FEATURE_TABLE_SECTORS,
+                 .formatFeatures =
+                     UFAT_FEATURE_DIR_TABLE | UFAT_FEATURE_SECTOR_CRC |
+                     UFAT_FEATURE_PING_PONG,
+                 .options = UFAT_OPT_CONTIGUOUS,
+                 .dirSlots = FEATURE_DIR_SLOTS,
+                 .dirEntries = 8,
+                 .write_block_device = write_block_page,
+                 .read_block_device = read_block_device,
+                 .writev_block_device = writev_block_device,
+                 .readv_block_device = readv_block_device};
+
+/* fs1 geometry allocating 4 sectors per table entry */
+ufat_fs_t fs8 = {.addressStart = 0,
+                 .sectors = FAKE_PROM_SIZE / FAKE_PROM_SECTOR_SIZE,
+                 .sectorSize = FAKE_PROM_SECTOR_SIZE,
+                 .tableSectors = (FAKE_PROM_SIZE / FAKE_PROM_SECTOR_SIZE) *
+                                 sizeof(ufat_sector_t) / FAKE_PROM_SECTOR_SIZE,
+                 .clusterShift = 2,
+                 .dirEntries = 16,
+                 .write_block_device = write_block_page,
+                 .read_block_device = read_block_device};
+
+ufat_fs_t fs6 = {.addressStart = 0,
+                 .sectors = LARGE_PROM_SECTORS,
+                 .sectorSize = LARGE_PROM_SECTOR_SIZE,
+                 .tableSectors = LARGE_TABLE_SECTORS,
+                 .formatFeatures = UFAT_FEATURE_LARGE_FILES,
+                 .dirEntries = 4,
+                 .write_block_device = write_block_page,
+                 .read_block_device = read_block_device};
+
+/* fs6 geometry in the 16 bit length format */
+ufat_fs_t fs7 = {.addressStart = 0,
+                 .sectors = LARGE_PROM_SECTORS,
+                 .sectorSize = LARGE_PROM_SECTOR_SIZE,
+                 .tableSectors = LARGE_TABLE_SECTORS,
                  .write_block_device = write_block_page,
                  .read_block_device = read_block_device};
 
+/* Table paged through three sector slots on the asynchronous driver */
+ufat_fs_t fs9 = {.addressStart = 0,
+                 .sectors = PAGED_PROM_SECTORS,
+                 .sectorSize = FAKE_PROM_SECTOR_SIZE,
+                 .tableSectors = PAGED_TABLE_SECTORS,
+                 .pageSlots = PAGED_SLOTS,
+                 .formatFeatures =
+                     UFAT_FEATURE_DIR_TABLE | UFAT_FEATURE_SECTOR_CRC |
+                     UFAT_FEATURE_PING_PONG,
+                 .dirSlots = FEATURE_DIR_SLOTS,
+                 .write_block_device = idle_write_block_device,
+                 .read_block_device = idle_read_block_device,
+                 .submit_block_device = submit_block_device,
+                 .complete_block_device = complete_block_device};
+
+/* fs9 volume with the whole table in RAM */
+ufat_fs_t fs10 = {.addressStart = 0,
+                  .sectors = PAGED_PROM_SECTORS,
+                  .sectorSize = FAKE_PROM_SECTOR_SIZE,
+                  .tableSectors = PAGED_TABLE_SECTORS,
+                  .formatFeatures =
+                      UFAT_FEATURE_DIR_TABLE | UFAT_FEATURE_SECTOR_CRC |
+                      UFAT_FEATURE_PING_PONG,
+                  .dirSlots = FEATURE_DIR_SLOTS,
+                  .write_block_device = write_block_page,
+                  .read_block_device = read_block_device};
+
+#ifdef UFAT_WIDE_TABLE
+ufat_fs_t fs5 = {.addressStart = 0,
+                 .sectors = WIDE_PROM_SECTORS,
+                 .sectorSize = FAKE_PROM_SECTOR_SIZE,
+                 .tableSectors = WIDE_PROM_SECTORS * sizeof(ufat_sector_t) /
+                                 FAKE_PROM_SECTOR_SIZE,
+                 .dirEntries = 16,
+                 .write_block_device = write_block_page,
+                 .read_block_device = read_block_device};
+#endif
+
 TEST_GROUP(POWERSTRESS);
 
 TEST_SETUP(POWERSTRESS) {
   takeDownTest = 0;
-  memset(block, 0, FAKE_PROM_SIZE);
+  memset(block, 0, sizeof(block));
   fs1.buff = malloc(FAKE_PROM_TABLE_SECTORS * FAKE_PROM_SECTOR_SIZE *
                     sizeof(ufat_sector_t));
   fs1.fat = malloc(FAKE_PROM_TABLE_SECTORS * FAKE_PROM_SECTOR_SIZE *
                    sizeof(ufat_sector_t));
-  test = malloc(0x2000);
-  validate = malloc(0x2000);
-  compare = malloc(0x2000);
+  fs1.dir = malloc(fs1.dirEntries * sizeof(ufat_dir_entry_t));
+  fs1.freeMap = malloc(sizeof(uint32_t) * ((fs1.sectors + 31) / 32));
+  fs2.buff = malloc(FEATURE_TABLE_SECTORS * FAKE_PROM_SECTOR_SIZE);
+  fs2.fat = malloc(FEATURE_TABLE_SECTORS * FAKE_PROM_SECTOR_SIZE);
+  fs2.dir = malloc(fs2.dirEntries * sizeof(ufat_dir_entry_t));
+  fs3.buff = malloc(fs3.tableSectors * FAKE_PROM_SECTOR_SIZE);
+  fs3.fat = malloc(fs3.tableSectors * FAKE_PROM_SECTOR_SIZE);
+  fs4.buff = malloc(fs4.tableSectors * FAKE_PROM_SECTOR_SIZE);
+  fs4.fat = malloc(fs4.tableSectors * FAKE_PROM_SECTOR_SIZE);
+  fs4.stage[0] = malloc(FAKE_PROM_SECTOR_SIZE);
+  fs4.stage[1] = malloc(FAKE_PROM_SECTOR_SIZE);
+  fs8.buff = malloc(fs8.tableSectors * FAKE_PROM_SECTOR_SIZE);
+  fs8.fat = malloc(fs8.tableSectors * FAKE_PROM_SECTOR_SIZE);
+  fs8.dir = malloc(fs8.dirEntries * sizeof(ufat_dir_entry_t));
+  fs8.freeMap = malloc(sizeof(uint32_t) * ((fs8.sectors + 31) / 32));
+  fs6.buff = malloc(fs6.tableSectors * LARGE_PROM_SECTOR_SIZE);
+  fs6.fat = malloc(fs6.tableSectors * LARGE_PROM_SECTOR_SIZE);
+  fs6.dir = malloc(fs6.dirEntries * sizeof(ufat_dir_entry_t));
+  fs7.buff = malloc(fs7.tableSectors * LARGE_PROM_SECTOR_SIZE);
+  fs7.fat = malloc(fs7.tableSectors * LARGE_PROM_SECTOR_SIZE);
+  fs9.buff = malloc(FAKE_PROM_SECTOR_SIZE);
+  fs9.pages = malloc(PAGED_SLOTS * FAKE_PROM_SECTOR_SIZE);
+  fs9.stage[0] = malloc(FAKE_PROM_SECTOR_SIZE);
+  fs9.stage[1] = malloc(FAKE_PROM_SECTOR_SIZE);
+  fs10.buff = malloc(fs10.tableSectors * FAKE_PROM_SECTOR_SIZE);
+  fs10.fat = malloc(fs10.tableSectors * FAKE_PROM_SECTOR_SIZE);
+#ifdef UFAT_WIDE_TABLE
+  fs5.buff = malloc(fs5.tableSectors * FAKE_PROM_SECTOR_SIZE);
+  fs5.fat = malloc(fs5.tableSectors * FAKE_PROM_SECTOR_SIZE);
+  fs5.dir = malloc(fs5.dirEntries * sizeof(ufat_dir_entry_t));
+  fs5.freeMap = malloc(sizeof(uint32_t) * ((fs5.sectors + 31) / 32));
+#endif
+  memset(&bus, 0, sizeof(bus));
+  test = malloc(TEST_BUFFER_SIZE);
+  validate = malloc(TEST_BUFFER_SIZE);
+  compare = malloc(TEST_BUFFER_SIZE);
 #ifdef TRACE_ENABLE
   traceBuffer = malloc(TRACE_BUFFER_SIZE);
 #endif
@@ -162,6 +425,38 @@ TEST_SETUP(POWERSTRESS) {
 TEST_TEAR_DOWN(POWERSTRESS) { 
     free(fs1.buff); 
     free(fs1.fat);
+    free(fs1.dir);
+    free(fs1.freeMap);
+    free(fs2.buff);
+    free(fs2.fat);
+    free(fs2.dir);
+    free(fs3.buff);
+    free(fs3.fat);
+    free(fs4.buff);
+    free(fs4.fat);
+    free(fs4.stage[0]);
+    free(fs4.stage[1]);
+    free(fs8.buff);
+    free(fs8.fat);
+    free(fs8.dir);
+    free(fs8.freeMap);
+    free(fs6.buff);
+    free(fs6.fat);
+    free(fs6.dir);
+    free(fs7.buff);
+    free(fs7.fat);
+    free(fs9.buff);
+    free(fs9.pages);
+    free(fs9.stage[0]);
+    free(fs9.stage[1]);
+    free(fs10.buff);
+    free(fs10.fat);
+#ifdef UFAT_WIDE_TABLE
+    free(fs5.buff);
+    free(fs5.fat);
+    free(fs5.dir);
+    free(fs5.freeMap);
+#endif
     free(test);
     free(validate);
     free(compare);
@@ -178,13 +473,13 @@ TEST_TEAR_DOWN(POWERSTRESS) {
     test = validate = compare = NULL;
 }
 
-int PowerStressTest(ufat_fs_t *fs) {
+int PowerStressTest(ufat_fs_t *fs, uint32_t cycles) {
   uint32_t i, j, tl, testLength;
   uint32_t powerCycleTest = 0;
   uint32_t powerCycleTestResult = 0;
   uint32_t powerCycleValidate = 0;
   uint64_t bytesWritten = 0;
-  uint32_t cycles = POWER_CYCLE_COUNT;
+  uint32_t cycleCount = cycles;
   int32_t res = 0;
   char buf[128];
   ufat_FILE f;
@@ -369,6 +664,13 @@ int PowerStressTest(ufat_fs_t *fs) {
           break;
         }
       }
+      if (res == 0 && getRand() % 16 == 0) {
+        /* Clean mount path, torn unmounts included */
+        res = ufat_unmount(fs);
+        if (res == 0) {
+          res = ufat_mount(fs);
+        }
+      }
     }
     if (res != UFAT_ERR_IO) {
       printf("\r\nPower test stress failed err %s\r\n", ufat_errstr(res));
@@ -377,7 +679,7 @@ int PowerStressTest(ufat_fs_t *fs) {
     res = 0;
     if (cycles-- == 0) {
       printf("\r\nPower stress test passed (%i/%i)\r\n%i KB written\r\n",
-             powerCycleTestResult, POWER_CYCLE_COUNT,
+             powerCycleTestResult, cycleCount,
              (int)(bytesWritten / 1000));
       break;
     }
@@ -583,10 +885,1209 @@ int randomWriteLengths(ufat_fs_t *fs) {
   }
 }
 
+int dirIndexTest(ufat_fs_t *fs) {
+  int res;
+  uint32_t i, reads;
+  char buf[32];
+  ufat_FILE f;
+  takeDownTest = 0;
+  res = ufat_format(fs);
+  res |= ufat_mount(fs);
+  for (i = 0; i < 8 && res == UFAT_OK; i++) {
+    sprintf(buf, "index%i.bin", i);
+    res = ufat_fopen(fs, buf, "w", &f);
+    if (res == UFAT_OK) {
+      res = ufat_fwrite(fs, buf, 1, i + 1, &f) == i + 1 ? UFAT_OK : 1;
+      res |= ufat_fclose(fs, &f);
+    }
+  }
+  res |= ufat_remove(fs, "index3.bin");
+  res |= ufat_mount(fs);
+  if (res) {
+    TEST_MESSAGE("Index setup failed");
+    return 1;
+  }
+  reads = readCount;
+  for (i = 0; i < 8; i++) {
+    sprintf(buf, "index%i.bin", i);
+    if (ufat_exists(fs, buf) != (int)(i == 3 ? 0 : i + 1)) {
+      TEST_MESSAGE("Index lookup mismatch");
+      return 1;
+    }
+  }
+  if (ufat_exists(fs, "missing.bin") != 0 ||
+      ufat_fopen(fs, "missing.bin", "r", &f) != UFAT_ERR_FILE_NOT_FOUND) {
+    TEST_MESSAGE("Index reported a missing file");
+    return 1;
+  }
+  if (readCount != reads) {
+    TEST_MESSAGE("Index lookups touched the device");
+    return 1;
+  }
+  TEST_MESSAGE("Directory index test passed");
+  return 0;
+}
+
+int freeCountTest(ufat_fs_t *fs) {
+  int res;
+  uint32_t empty, used;
+  ufat_FILE f;
+  takeDownTest = 0;
+  res = ufat_format(fs);
+  res |= ufat_mount(fs);
+  empty = ufat_freecount(fs);
+  if (res || empty != fs->sectors - (UFAT_TABLE_COUNT * fs->tableSectors)) {
+    TEST_MESSAGE("Free count wrong after format");
+    return 1;
+  }
+  /* Header plus 0x123 bytes spans 5 sectors */
+  res = ufat_fopen(fs, "free.bin", "w", &f);
+  res |= ufat_fwrite(fs, test, 1, 0x123, &f) == 0x123 ? UFAT_OK : 1;
+  res |= ufat_fclose(fs, &f);
+  used = empty - ufat_freecount(fs);
+  res |= ufat_mount(fs);
+  if (res || used != 5 || ufat_freecount(fs) != empty - used) {
+    TEST_MESSAGE("Free count wrong after write");
+    return 1;
+  }
+  res = ufat_remove(fs, "free.bin");
+  if (res || ufat_freecount(fs) != empty) {
+    TEST_MESSAGE("Free count wrong after remove");
+    return 1;
+  }
+  TEST_MESSAGE("Free count test passed");
+  return 0;
+}
+
+/* Runs of physically consecutive sectors in a file chain */
+static uint32_t fileFragments(ufat_fs_t *fs, const char *name) {
+  ufat_FILE f;
+  uint32_t sector, next, fragments = 1;
+  if (ufat_fopen(fs, name, "r", &f) != UFAT_OK) {
+    return 0;
+  }
+  sector = f.startSector;
+  while ((next = fs->fat->sector[sector].next) != UFAT_MAX_SECTORS) {
+    if (next != sector + 1) {
+      fragments++;
+    }
+    sector = next;
+  }
+  ufat_fclose(fs, &f);
+  return fragments;
+}
+
+int fragmentationTest(ufat_fs_t *fs) {
+  int res;
+  uint32_t i, empty;
+  uint32_t hinted, grown;
+  ufat_FILE a, b;
+  takeDownTest = 0;
+  res = ufat_format(fs);
+  res |= ufat_mount(fs);
+  empty = ufat_freecount(fs);
+  /* Interleaved writers are the worst case for scattering */
+  res |= ufat_fopen(fs, "hinted.bin", "w", &a);
+  res |= ufat_fsizehint(&a, 1200);
+  res |= ufat_fopen(fs, "grown.bin", "w", &b);
+  for (i = 0; i < 1200 && res == UFAT_OK; i += 40) {
+    res |= ufat_fwrite(fs, &test[i], 1, 40, &a) == 40 ? UFAT_OK : 1;
+    res |= ufat_fwrite(fs, &test[i], 1, 40, &b) == 40 ? UFAT_OK : 1;
+  }
+  res |= ufat_fclose(fs, &a);
+  res |= ufat_fclose(fs, &b);
+  hinted = fileFragments(fs, "hinted.bin");
+  grown = fileFragments(fs, "grown.bin");
+  printf("Fragments hinted %i, grown %i\r\n", hinted, grown);
+  if (res || hinted != 1 || grown == 0 || grown > 5) {
+    TEST_MESSAGE("Files were fragmented");
+    return 1;
+  }
+  /* Unused reservations are returned on close */
+  if (empty - ufat_freecount(fs) != 2 * ((1200 + 28 + 63) / 64)) {
+    TEST_MESSAGE("Reserved sectors leaked");
+    return 1;
+  }
+  TEST_MESSAGE("Fragmentation test passed");
+  return 0;
+}
+
+int commitSizeTest(ufat_fs_t *fs) {
+  int res;
+  uint32_t i, bytes, full;
+  char buf[32];
+  ufat_FILE f;
+  takeDownTest = 0;
+  res = ufat_format(fs);
+  res |= ufat_mount(fs);
+  full = 0;
+  for (i = 0; i < 10 && res == UFAT_OK; i++) {
+    sprintf(buf, "commit%i.bin", i % 3);
+    bytes = writeBytes;
+    res = ufat_fopen(fs, buf, "w", &f);
+    res |= ufat_fwrite(fs, buf, 1, 1, &f) == 1 ? UFAT_OK : 1;
+    res |= ufat_fclose(fs, &f);
+    /* Less the data byte and the file header */
+    full += writeBytes - bytes - 1 - sizeof(ufat_file_t);
+  }
+  res |= ufat_mount(fs);
+  printf("Table bytes per close %i of %i\r\n", full / 10,
+         UFAT_TABLE_COUNT * fs->tableSectors * fs->sectorSize);
+  if (res ||
+      full / 10 >= UFAT_TABLE_COUNT * fs->tableSectors * fs->sectorSize) {
+    TEST_MESSAGE("Commit rewrote the whole table");
+    return 1;
+  }
+  TEST_MESSAGE("Commit size test passed");
+  return 0;
+}
+
+int nameTableTest(ufat_fs_t *fs) {
+  int res;
+  uint32_t i, reads;
+  char buf[32];
+  ufat_FILE f;
+  takeDownTest = 0;
+  res = ufat_format(fs);
+  res |= ufat_mount(fs);
+  /* Overflow the name table, then shrink back under it */
+  for (i = 0; i < FEATURE_DIR_SLOTS + 4 && res == UFAT_OK; i++) {
+    sprintf(buf, "name%i.bin", i);
+    res = ufat_fopen(fs, buf, "w", &f);
+    if (res == UFAT_OK) {
+      res = ufat_fwrite(fs, buf, 1, i + 1, &f) == i + 1 ? UFAT_OK : 1;
+      res |= ufat_fclose(fs, &f);
+    }
+  }
+  for (i = 0; i < 8 && res == UFAT_OK; i++) {
+    sprintf(buf, "name%i.bin", i * 2);
+    res = ufat_remove(fs, buf);
+  }
+  /* Rebuilds the name table */
+  res |= ufat_mount(fs);
+  res |= ufat_mount(fs);
+  if (res) {
+    TEST_MESSAGE("Name table setup failed");
+    return 1;
+  }
+  reads = readCount;
+  res = ufat_mount(fs);
+  if (res || readCount - reads != UFAT_TABLE_COUNT) {
+    TEST_MESSAGE("Name table mount read file headers");
+    return 1;
+  }
+  for (i = 0; i < FEATURE_DIR_SLOTS + 4; i++) {
+    sprintf(buf, "name%i.bin", i);
+    reads = readCount;
+    if (ufat_exists(fs, buf) !=
+        (int)((i < 16 && (i & 1) == 0) ? 0 : i + 1)) {
+      TEST_MESSAGE("Name table lookup mismatch");
+      return 1;
+    }
+    if (readCount - reads > 1) {
+      TEST_MESSAGE("Name table lookup was not O(1)");
+      return 1;
+    }
+  }
+  TEST_MESSAGE("Name table test passed");
+  return 0;
+}
+
+int pingPongTest(ufat_fs_t *fs) {
+  int res;
+  uint32_t i, copy, bytes;
+  ufat_FILE f;
+  takeDownTest = 0;
+  res = ufat_format(fs);
+  res |= ufat_mount(fs);
+  for (i = 1; i <= 3 && res == UFAT_OK; i++) {
+    copy = fs->tableIndex;
+    bytes = writeBytes;
+    res = ufat_fopen(fs, "pingpong.bin", "w", &f);
+    res |= ufat_fwrite(fs, validate, 1, i, &f) == i ? UFAT_OK : 1;
+    res |= ufat_fclose(fs, &f);
+    if (fs->tableIndex == copy ||
+        writeBytes - bytes > i + sizeof(ufat_file_t) +
+                                 fs->tableSectors * fs->sectorSize) {
+      TEST_MESSAGE("Commit did not write a single copy");
+      return 1;
+    }
+  }
+  /* Tear the newest copy, mount falls back to the previous commit */
+  block[fs->addressStart + fs->tableIndex * fs->tableSectors * fs->sectorSize +
+        fs->sectorSize] ^= 0xFF;
+  res |= ufat_mount(fs);
+  if (res || ufat_exists(fs, "pingpong.bin") != 2) {
+    TEST_MESSAGE("Mount did not fall back to the older copy");
+    return 1;
+  }
+  TEST_MESSAGE("Ping pong test passed");
+  return 0;
+}
+
+static int tableWritten(ufat_fs_t *fs) {
+  return memcmp(&compare[0x1000], block,
+                UFAT_TABLE_COUNT * fs->tableSectors * fs->sectorSize) != 0;
+}
+
+static void tableSnapshot(ufat_fs_t *fs) {
+  memcpy(&compare[0x1000], block,
+         UFAT_TABLE_COUNT * fs->tableSectors * fs->sectorSize);
+}
+
+static int readMatches(ufat_fs_t *fs, const char *name, uint8_t *data,
+                       uint32_t len) {
+  ufat_FILE f;
+  if (ufat_fopen(fs, name, "r", &f) != UFAT_OK) {
+    return 0;
+  }
+  if (ufat_fread(fs, compare, 1, len, &f) != len) {
+    ufat_fclose(fs, &f);
+    return 0;
+  }
+  ufat_fclose(fs, &f);
+  return memcmp(compare, data, len) == 0;
+}
+
+/* A lookup that fails on a read leaves the file and its sectors alone */
+int removeErrorTest(ufat_fs_t *fs) {
+  int res;
+  uint32_t empty;
+  ufat_FILE f;
+  takeDownTest = 0;
+  res = ufat_format(fs);
+  res |= ufat_mount(fs);
+  res |= ufat_fopen(fs, "keep.bin", "w", &f);
+  res |= ufat_fwrite(fs, validate, 1, 0x100, &f) == 0x100 ? UFAT_OK : 1;
+  res |= ufat_fclose(fs, &f);
+  res |= ufat_sync(fs);
+  empty = ufat_freecount(fs);
+  takeDownTest = 1;
+  takeDownFlags = TAKE_DOWN_READ;
+  takeDownPeriod = 0;
+  res |= ufat_remove(fs, "keep.bin") == UFAT_ERR_IO ? UFAT_OK : 1;
+  takeDownTest = 0;
+  res |= ufat_mount(fs);
+  if (res || ufat_freecount(fs) != empty ||
+      !readMatches(fs, "keep.bin", validate, 0x100)) {
+    TEST_MESSAGE("Failed lookup changed the volume");
+    return 1;
+  }
+  TEST_MESSAGE("Remove error test passed");
+  return 0;
+}
+
+int transactionTest(ufat_fs_t *fs) {
+  int res;
+  uint32_t i, bytes;
+  uint32_t tableArea = UFAT_TABLE_COUNT * fs->tableSectors * fs->sectorSize;
+  char buf[32];
+  ufat_FILE f;
+  takeDownTest = 0;
+  res = ufat_format(fs);
+  res |= ufat_mount(fs);
+  res |= ufat_fopen(fs, "keep.bin", "w", &f);
+  res |= ufat_fwrite(fs, validate, 1, 0x200, &f) == 0x200 ? UFAT_OK : 1;
+  res |= ufat_fclose(fs, &f);
+  tableSnapshot(fs);
+  /* Replace keep.bin and fill the volume, then lose the transaction */
+  res |= ufat_begin(fs);
+  res |= ufat_fopen(fs, "keep.bin", "w", &f);
+  res |= ufat_fwrite(fs, test, 1, 0x200, &f) == 0x200 ? UFAT_OK : 1;
+  res |= ufat_fclose(fs, &f);
+  for (i = 0; ufat_freecount(fs) >= 5 && res == UFAT_OK; i++) {
+    sprintf(buf, "txn%i.bin", i);
+    res = ufat_fopen(fs, buf, "w", &f);
+    res |= ufat_fwrite(fs, test, 1, 0x100, &f) == 0x100 ? UFAT_OK : 1;
+    res |= ufat_fclose(fs, &f);
+  }
+  if (res || tableWritten(fs)) {
+    TEST_MESSAGE("Transaction wrote the table");
+    return 1;
+  }
+  res = ufat_mount(fs);
+  if (res || ufat_exists(fs, "txn0.bin") ||
+      !readMatches(fs, "keep.bin", validate, 0x200)) {
+    TEST_MESSAGE("Lost transaction changed the volume");
+    return 1;
+  }
+  /* Committed in a single table write */
+  res = ufat_begin(fs);
+  res |= ufat_fopen(fs, "keep.bin", "w", &f);
+  res |= ufat_fwrite(fs, test, 1, 0x200, &f) == 0x200 ? UFAT_OK : 1;
+  res |= ufat_fclose(fs, &f);
+  for (i = 0; i < 4 && res == UFAT_OK; i++) {
+    sprintf(buf, "txn%i.bin", i);
+    res = ufat_fopen(fs, buf, "w", &f);
+    res |= ufat_fwrite(fs, buf, 1, 8, &f) == 8 ? UFAT_OK : 1;
+    res |= ufat_fclose(fs, &f);
+  }
+  res |= ufat_remove(fs, "txn0.bin");
+  bytes = writeBytes;
+  res |= ufat_commit(fs);
+  res |= ufat_mount(fs);
+  if (res || writeBytes - bytes > tableArea || ufat_exists(fs, "txn0.bin") ||
+      ufat_exists(fs, "txn3.bin") != 8 ||
+      !readMatches(fs, "keep.bin", test, 0x200)) {
+    TEST_MESSAGE("Transaction commit failed");
+    return 1;
+  }
+  res = ufat_begin(fs);
+  res |= ufat_remove(fs, "keep.bin");
+  if (res || ufat_exists(fs, "keep.bin")) {
+    TEST_MESSAGE("Transaction remove failed");
+    return 1;
+  }
+  res = ufat_abort(fs);
+  if (res || !readMatches(fs, "keep.bin", test, 0x200)) {
+    TEST_MESSAGE("Transaction abort failed");
+    return 1;
+  }
+  TEST_MESSAGE("Transaction test passed");
+  return 0;
+}
+
+int writeBackTest(ufat_fs_t *fs) {
+  int res;
+  uint32_t i;
+  char buf[32];
+  ufat_FILE f;
+  takeDownTest = 0;
+  res = ufat_format(fs);
+  res |= ufat_mount(fs);
+  tableSnapshot(fs);
+  /* Flushed on the commitOps close */
+  for (i = 0; i < fs->commitOps && res == UFAT_OK; i++) {
+    if (tableWritten(fs)) {
+      TEST_MESSAGE("Write back flushed early");
+      return 1;
+    }
+    sprintf(buf, "wb%i.bin", i);
+    res = ufat_fopen(fs, buf, "w", &f);
+    res |= ufat_fwrite(fs, buf, 1, 8, &f) == 8 ? UFAT_OK : 1;
+    res |= ufat_fclose(fs, &f);
+  }
+  if (res || !tableWritten(fs)) {
+    TEST_MESSAGE("Write back did not flush after commitOps");
+    return 1;
+  }
+  /* Flushed by the clock on the next open */
+  tableSnapshot(fs);
+  res = ufat_remove(fs, "wb0.bin");
+  clockTicks += fs->commitTicks;
+  if (res || tableWritten(fs)) {
+    TEST_MESSAGE("Write back remove was not deferred");
+    return 1;
+  }
+  res = ufat_fopen(fs, "wb1.bin", "r", &f);
+  res |= ufat_fclose(fs, &f);
+  if (res || !tableWritten(fs)) {
+    TEST_MESSAGE("Write back did not flush at the deadline");
+    return 1;
+  }
+  /* Lost without ufat_sync, kept with it */
+  res = ufat_remove(fs, "wb1.bin");
+  res |= ufat_mount(fs);
+  if (res || ufat_exists(fs, "wb1.bin") != 8) {
+    TEST_MESSAGE("Unflushed remove reached the media");
+    return 1;
+  }
+  res = ufat_remove(fs, "wb1.bin");
+  res |= ufat_sync(fs);
+  res |= ufat_mount(fs);
+  if (res || ufat_exists(fs, "wb1.bin") || ufat_exists(fs, "wb0.bin") ||
+      ufat_exists(fs, "wb2.bin") != 8) {
+    TEST_MESSAGE("Write back sync failed");
+    return 1;
+  }
+  TEST_MESSAGE("Write back test passed");
+  return 0;
+}
+
+int unmountTest(ufat_fs_t *fs) {
+  int res;
+  uint32_t empty, reads;
+  uint32_t nameTable = fs->formatFeatures & UFAT_FEATURE_DIR_TABLE;
+  ufat_FILE f, open;
+  takeDownTest = 0;
+  res = ufat_format(fs);
+  res |= ufat_mount(fs);
+  res |= ufat_fopen(fs, "clean.bin", "w", &f);
+  res |= ufat_fwrite(fs, validate, 1, 0x100, &f) == 0x100 ? UFAT_OK : 1;
+  res |= ufat_fclose(fs, &f);
+  empty = ufat_freecount(fs);
+  /* Left open, unmount frees its sectors */
+  res |= ufat_fopen(fs, "open.bin", "w", &open);
+  res |= ufat_fwrite(fs, validate, 1, 0x100, &open) == 0x100 ? UFAT_OK : 1;
+  res |= ufat_unmount(fs);
+  if (res || fs->freeCount != empty) {
+    TEST_MESSAGE("Unmount did not count the freed sectors");
+    return 1;
+  }
+  reads = readCount;
+  res |= ufat_mount(fs);
+  if (res || (nameTable && readCount - reads != 1)) {
+    TEST_MESSAGE("Clean mount was not a single read");
+    return 1;
+  }
+  if (ufat_freecount(fs) != empty || ufat_exists(fs, "open.bin") ||
+      !readMatches(fs, "clean.bin", validate, 0x100)) {
+    TEST_MESSAGE("Clean mount state mismatch");
+    return 1;
+  }
+  /* The first commit clears the marker from both copies */
+  res = ufat_fopen(fs, "after.bin", "w", &f);
+  res |= ufat_fwrite(fs, test, 1, 0x100, &f) == 0x100 ? UFAT_OK : 1;
+  res |= ufat_fclose(fs, &f);
+  reads = readCount;
+  res |= ufat_mount(fs);
+  if (res || (nameTable && readCount - reads == 1) ||
+      !readMatches(fs, "after.bin", test, 0x100) ||
+      !readMatches(fs, "clean.bin", validate, 0x100)) {
+    TEST_MESSAGE("Commit after a clean mount failed");
+    return 1;
+  }
+  TEST_MESSAGE("Unmount test passed");
+  return 0;
+}
+
+int mountReadsTest(ufat_fs_t *fs) {
+  int res;
+  uint32_t i, reads;
+  uint32_t copy = fs->tableSectors * fs->sectorSize;
+  uint32_t pingPong = fs->formatFeatures & UFAT_FEATURE_PING_PONG;
+  takeDownTest = 0;
+  res = ufat_format(fs);
+  /* Good copies, then each copy torn in turn */
+  for (i = 0; i <= UFAT_TABLE_COUNT && res == UFAT_OK; i++) {
+    if (i > 0) {
+      block[fs->addressStart + (i - 1) * copy + fs->sectorSize] ^= 0xFF;
+    }
+    reads = readCount;
+    res = ufat_mount(fs);
+    if (res || readCount - reads != UFAT_TABLE_COUNT) {
+      printf("Mount %i took %i reads\r\n", i, readCount - reads);
+      TEST_MESSAGE("Mount read a table copy twice");
+      return 1;
+    }
+    if (pingPong && i > 0) {
+      /* Left for the next commit, undo it so one copy stays good */
+      block[fs->addressStart + (i - 1) * copy + fs->sectorSize] ^= 0xFF;
+    } else if (memcmp(&block[fs->addressStart],
+                      &block[fs->addressStart + copy], fs->tableBytes)) {
+      TEST_MESSAGE("Mount did not repair the torn copy");
+      return 1;
+    }
+  }
+  res |= ufat_unmount(fs);
+  reads = readCount;
+  res |= ufat_mount(fs);
+  if (res || readCount - reads != 1) {
+    TEST_MESSAGE("Clean mount read more than one copy");
+    return 1;
+  }
+  TEST_MESSAGE("Mount reads test passed");
+  return 0;
+}
+
+int vectoredTest(ufat_fs_t *fs) {
+  int res;
+  uint32_t calls, segments;
+  uint32_t len = 4 * fs->sectorSize;
+  char info[512];
+  ufat_FILE f;
+  takeDownTest = 0;
+  res = ufat_format(fs);
+  res |= ufat_mount(fs);
+  res |= ufat_fopen(fs, "vector.bin", "w", &f);
+  res |= ufat_fsizehint(&f, len);
+  calls = vectorCalls;
+  segments = vectorSegments;
+  res |= ufat_fwrite(fs, validate, 1, len, &f) == len ? UFAT_OK : 1;
+  if (res || vectorCalls - calls != 1) {
+    TEST_MESSAGE("fwrite was not one driver submission");
+    return 1;
+  }
+  /* Hinted, so the sectors are one run and one segment */
+  if ((fs->options & UFAT_OPT_CONTIGUOUS) &&
+      vectorSegments - segments != 1) {
+    TEST_MESSAGE("fwrite did not merge adjacent sectors");
+    return 1;
+  }
+  res |= ufat_fclose(fs, &f);
+  res |= ufat_fopen(fs, "vector.bin", "r", &f);
+  calls = vectorCalls;
+  segments = vectorSegments;
+  res |= ufat_fread(fs, compare, 1, len, &f) == len ? UFAT_OK : 1;
+  res |= ufat_fclose(fs, &f);
+  if (res || vectorCalls - calls != 1 || memcmp(compare, validate, len)) {
+    TEST_MESSAGE("fread was not one driver submission");
+    return 1;
+  }
+  if ((fs->options & UFAT_OPT_CONTIGUOUS) &&
+      vectorSegments - segments != 1) {
+    TEST_MESSAGE("fread did not merge adjacent sectors");
+    return 1;
+  }
+  res |= ufat_fopen(fs, "second.bin", "w", &f);
+  res |= ufat_fwrite(fs, test, 1, 0x10, &f) == 0x10 ? UFAT_OK : 1;
+  res |= ufat_fclose(fs, &f);
+  calls = vectorCalls;
+  if (res || ufat_fsinfo(fs, info, sizeof(info)) < 0 ||
+      vectorCalls - calls != 1) {
+    TEST_MESSAGE("fsinfo headers were not one driver submission");
+    return 1;
+  }
+  TEST_MESSAGE("Vectored IO test passed");
+  return 0;
+}
+
+int asyncTest(ufat_fs_t *fs) {
+  int res;
+  uint32_t calls;
+  uint32_t len = 5 * fs->sectorSize;
+  /* The header shares the first sector */
+  uint32_t chunks = (len + sizeof(ufat_file_t) + fs->sectorSize - 1) /
+                    fs->sectorSize;
+  ufat_FILE f;
+  takeDownTest = 0;
+  res = ufat_format(fs);
+  res |= ufat_mount(fs);
+  res |= ufat_fopen(fs, "async.bin", "w", &f);
+  calls = asyncCalls;
+  res |= ufat_fwrite(fs, validate, 1, len, &f) == len ? UFAT_OK : 1;
+  if (res || bus.busy || asyncCalls - calls != chunks) {
+    TEST_MESSAGE("fwrite did not stream through the async driver");
+    return 1;
+  }
+  res |= ufat_fclose(fs, &f);
+  calls = asyncCalls;
+  if (res || !readMatches(fs, "async.bin", validate, len) || bus.busy ||
+      asyncCalls - calls != chunks) {
+    TEST_MESSAGE("fread did not stream through the async driver");
+    return 1;
+  }
+  TEST_MESSAGE("Async driver test passed");
+  return 0;
+}
+
+int zeroCopyTest(ufat_fs_t *fs) {
+  int res;
+  uint32_t len = 3 * fs->sectorSize;
+  ufat_FILE f;
+  takeDownTest = 0;
+  res = ufat_format(fs);
+  res |= ufat_mount(fs);
+  res |= ufat_fopen(fs, "zero.bin", "wbz", &f);
+  res |= ufat_fwrite(fs, validate, 1, len, &f) == len ? UFAT_OK : 1;
+  if (res || (fs->submit_block_device &&
+              (bus.data < validate || bus.data >= validate + len))) {
+    TEST_MESSAGE("Zero copy write went through a stage buffer");
+    return 1;
+  }
+  res |= ufat_fclose(fs, &f);
+  memset(compare, 0, len);
+  res |= ufat_fopen(fs, "zero.bin", "rz", &f);
+  res |= ufat_fread(fs, compare, 1, len, &f) == len ? UFAT_OK : 1;
+  res |= ufat_fclose(fs, &f);
+  if (res || memcmp(compare, validate, len) ||
+      (fs->submit_block_device &&
+       (bus.data < compare || bus.data >= compare + len))) {
+    TEST_MESSAGE("Zero copy read failed");
+    return 1;
+  }
+  if (ufat_fopen(fs, "zero.bin", "z", &f) != UFAT_ERR_UNSUPPORTED) {
+    TEST_MESSAGE("Bare z mode accepted");
+    return 1;
+  }
+  TEST_MESSAGE("Zero copy test passed");
+  return 0;
+}
+
+int seekTest(ufat_fs_t *fs) {
+  int res;
+  uint32_t i, pos, n, expect, reads;
+  uint32_t len = 0x500;
+  ufat_link_t map[8];
+  uint8_t chunk[0x20];
+  ufat_FILE f;
+  takeDownTest = 0;
+  res = ufat_format(fs);
+  res |= ufat_mount(fs);
+  res |= ufat_fopen(fs, "seek.bin", "w", &f);
+  res |= ufat_fwrite(fs, validate, 1, len, &f) == len ? UFAT_OK : 1;
+  res |= ufat_fclose(fs, &f);
+  res |= ufat_fopen(fs, "seek.bin", "r", &f);
+  /* The map holds the start of the chain, the rest is walked */
+  res |= ufat_fsetmap(&f, map, sizeof(map) / sizeof(map[0]));
+  for (i = 0; i < 200 && res == UFAT_OK; i++) {
+    pos = getRand() % (len + 1);
+    n = getRand() % sizeof(chunk);
+    expect = pos + n > len ? len - pos : n;
+    res = i & 1 ? ufat_fseek(fs, &f, pos, UFAT_SEEK_SET)
+                : ufat_fseek(fs, &f, pos - ufat_ftell(&f), UFAT_SEEK_CUR);
+    if (res || ufat_ftell(&f) != (int32_t)pos ||
+        ufat_fread(fs, chunk, 1, n, &f) != expect ||
+        memcmp(chunk, &validate[pos], expect)) {
+      printf("Seek to %i for %i failed\r\n", pos, n);
+      res = 1;
+    }
+  }
+  res |= ufat_fseek(fs, &f, -1, UFAT_SEEK_END);
+  res |= ufat_fread(fs, chunk, 1, 1, &f) == 1 ? UFAT_OK : 1;
+  if (res || chunk[0] != validate[len - 1] ||
+      ufat_fseek(fs, &f, len + 1, UFAT_SEEK_SET) != UFAT_ERR_RANGE) {
+    TEST_MESSAGE("Seek failed");
+    return 1;
+  }
+  /* Inside one sector, so a single device read */
+  res |= ufat_fseek(fs, &f, 0x10, UFAT_SEEK_SET);
+  reads = readCount;
+  res |= ufat_pread(fs, &f, 0x100, chunk, 0x10) == 0x10 ? UFAT_OK : 1;
+  if (res || readCount - reads != 1 || ufat_ftell(&f) != 0x10 ||
+      memcmp(chunk, &validate[0x100], 0x10)) {
+    TEST_MESSAGE("pread failed");
+    return 1;
+  }
+  res |= ufat_fclose(fs, &f);
+  TEST_MESSAGE("Seek test passed");
+  return res;
+}
+
+int appendTest(ufat_fs_t *fs) {
+  int res;
+  uint32_t i, n, written, cycle;
+  uint32_t len = 0x30;
+  uint32_t limit = 0x800;
+  uint32_t bound = fs->clusterSize + 2 * fs->tableSectors * fs->sectorSize;
+  ufat_FILE f;
+  takeDownTest = 0;
+  for (i = 0; i < limit; i++) {
+    test[i] = (uint8_t)getRand();
+  }
+  res = ufat_format(fs);
+  res |= ufat_mount(fs);
+  res |= ufat_fopen(fs, "log.bin", "a", &f);
+  res |= ufat_fwrite(fs, test, 1, len, &f) == len ? UFAT_OK : 1;
+  res |= ufat_fclose(fs, &f);
+  /* Each append writes its bytes, one head sector and the table */
+  while (res == UFAT_OK && len < limit / 2) {
+    n = 1 + getRand() % 100;
+    written = writeBytes;
+    res |= ufat_fopen(fs, "log.bin", "ab", &f);
+    res |= ufat_ftell(&f) == (int32_t)len ? UFAT_OK : 1;
+    res |= ufat_fwrite(fs, &test[len], 1, n, &f) == n ? UFAT_OK : 1;
+    res |= ufat_fclose(fs, &f);
+    len += n;
+    if (res || writeBytes - written > n + bound ||
+        !readMatches(fs, "log.bin", test, len)) {
+      printf("Append of %i at %i failed\r\n", n, len - n);
+      TEST_MESSAGE("Append failed");
+      return 1;
+    }
+  }
+  /* Power loss leaves the old or the new file */
+  for (cycle = 0; cycle < 200 && len + 100 < limit; cycle++) {
+    n = 1 + getRand() % 100;
+    takeDownTest = 1;
+    takeDownFlags = TAKE_DOWN_WRITE;
+    takeDownPeriod = getRand() % 8;
+    if (ufat_fopen(fs, "log.bin", "a", &f) == UFAT_OK) {
+      ufat_fwrite(fs, &test[len], 1, n, &f);
+      if (ufat_fclose(fs, &f) == UFAT_OK) {
+        len += n;
+      }
+    }
+    takeDownTest = 0;
+    res = ufat_mount(fs);
+    res |= ufat_fopen(fs, "log.bin", "r", &f);
+    /* A failed close may still have committed */
+    if (res == UFAT_OK && ufat_flength(&f) == len + n) {
+      len += n;
+    }
+    if (res || ufat_flength(&f) != len ||
+        !readMatches(fs, "log.bin", test, len)) {
+      printf("Append power cycle %i failed %s\r\n", cycle, ufat_errstr(res));
+      TEST_MESSAGE("Append was not atomic");
+      return 1;
+    }
+  }
+  TEST_MESSAGE("Append test passed");
+  return 0;
+}
+
+int updateTest(ufat_fs_t *fs) {
+  int res;
+  uint32_t i, pos, n, written, cycle;
+  uint32_t len = 0x600;
+  /* Head and two data sectors copied, the table committed once */
+  uint32_t bound = 3 * fs->clusterSize + 2 * fs->tableSectors * fs->sectorSize;
+  ufat_FILE f;
+  takeDownTest = 0;
+  for (i = 0; i < len; i++) {
+    test[i] = (uint8_t)getRand();
+  }
+  res = ufat_format(fs);
+  res |= ufat_mount(fs);
+  res |= ufat_fopen(fs, "rec.bin", "w", &f);
+  res |= ufat_fwrite(fs, test, 1, len, &f) == len ? UFAT_OK : 1;
+  res |= ufat_fclose(fs, &f);
+  res |= ufat_fopen(fs, "rec.bin", "r+", &f);
+  res |= ufat_fseek(fs, &f, -4, UFAT_SEEK_END);
+  res |= ufat_fwrite(fs, test, 1, 8, &f) == (size_t)UFAT_ERR_RANGE ? UFAT_OK
+                                                                     : 1;
+  res |= ufat_fclose(fs, &f);
+  if (res || !readMatches(fs, "rec.bin", test, len)) {
+    TEST_MESSAGE("Update past the end changed the file");
+    return 1;
+  }
+  /* A sector copied already takes only the changed bytes */
+  res = ufat_fopen(fs, "rec.bin", "r+", &f);
+  res |= ufat_fseek(fs, &f, 8, UFAT_SEEK_SET);
+  res |= ufat_fwrite(fs, validate, 1, 4, &f) == 4 ? UFAT_OK : 1;
+  written = writeBytes;
+  res |= ufat_fwrite(fs, &validate[4], 1, 4, &f) == 4 ? UFAT_OK : 1;
+  n = writeBytes - written;
+  res |= ufat_fclose(fs, &f);
+  memcpy(&test[8], validate, 8);
+  if (res || n != 4 || !readMatches(fs, "rec.bin", test, len)) {
+    TEST_MESSAGE("Update rewrote a whole copied sector");
+    return 1;
+  }
+  for (i = 0; i < 100 && res == UFAT_OK; i++) {
+    n = 1 + getRand() % 0x40;
+    pos = getRand() % (len - n + 1);
+    written = writeBytes;
+    res |= ufat_fopen(fs, "rec.bin", i & 1 ? "rb+" : "r+", &f);
+    res |= ufat_fseek(fs, &f, pos, UFAT_SEEK_SET);
+    res |= ufat_fread(fs, compare, 1, n, &f) == n ? UFAT_OK : 1;
+    res |= memcmp(compare, &test[pos], n) ? 1 : UFAT_OK;
+    res |= ufat_fseek(fs, &f, pos, UFAT_SEEK_SET);
+    memcpy(&test[pos], validate, n);
+    res |= ufat_fwrite(fs, validate, 1, n, &f) == n ? UFAT_OK : 1;
+    res |= ufat_ftell(&f) == (int32_t)(pos + n) ? UFAT_OK : 1;
+    res |= ufat_fclose(fs, &f);
+    if (res || writeBytes - written > n + bound ||
+        !readMatches(fs, "rec.bin", test, len)) {
+      printf("Update of %i at %i failed\r\n", n, pos);
+      TEST_MESSAGE("Update failed");
+      return 1;
+    }
+  }
+  /* Power loss leaves the old or the new content */
+  for (cycle = 0; cycle < 200; cycle++) {
+    n = 1 + getRand() % 0x100;
+    pos = getRand() % (len - n + 1);
+    memcpy(validate, test, len);
+    for (i = 0; i < n; i++) {
+      validate[pos + i] = (uint8_t)getRand();
+    }
+    takeDownTest = 1;
+    takeDownFlags = TAKE_DOWN_WRITE;
+    takeDownPeriod = getRand() % 8;
+    if (ufat_fopen(fs, "rec.bin", "r+", &f) == UFAT_OK &&
+        ufat_fseek(fs, &f, pos, UFAT_SEEK_SET) == UFAT_OK) {
+      ufat_fwrite(fs, &validate[pos], 1, n, &f);
+      ufat_fclose(fs, &f);
+    }
+    takeDownTest = 0;
+    res = ufat_mount(fs);
+    if (res == UFAT_OK && readMatches(fs, "rec.bin", validate, len)) {
+      memcpy(test, validate, len);
+    }
+    if (res || !readMatches(fs, "rec.bin", test, len)) {
+      printf("Update power cycle %i failed %s\r\n", cycle, ufat_errstr(res));
+      TEST_MESSAGE("Update was not atomic");
+      return 1;
+    }
+  }
+  /* validate is shared with the other tests */
+  for (i = 0; i < len; i++) {
+    validate[i] = (uint8_t)getRand();
+  }
+  TEST_MESSAGE("Update test passed");
+  return 0;
+}
+
+/* An "r+" stream copies at most UFAT_COW_SECTORS sectors, one more drops
+ * the whole update however small */
+int cowLimitTest(ufat_fs_t *fs) {
+  int res;
+  uint32_t i;
+  uint32_t len = (UFAT_COW_SECTORS + 1) * fs->clusterSize;
+  uint32_t empty;
+  ufat_FILE f;
+  takeDownTest = 0;
+  UFAT_ASSERT(len <= TEST_BUFFER_SIZE);
+  for (i = 0; i < len; i++) {
+    test[i] = (uint8_t)getRand();
+  }
+  res = ufat_format(fs);
+  res |= ufat_mount(fs);
+  res |= ufat_fopen(fs, "cow.bin", "w", &f);
+  res |= ufat_fwrite(fs, test, 1, len, &f) == len ? UFAT_OK : 1;
+  res |= ufat_fclose(fs, &f);
+  empty = ufat_freecount(fs);
+  res |= ufat_fopen(fs, "cow.bin", "r+", &f);
+  /* One byte in each sector, the head included */
+  for (i = 0; i < UFAT_COW_SECTORS && res == UFAT_OK; i++) {
+    res = ufat_fseek(fs, &f, i * fs->clusterSize, UFAT_SEEK_SET);
+    res |= ufat_fwrite(fs, validate, 1, 1, &f) == 1 ? UFAT_OK : 1;
+  }
+  /* Sectors copied already still take changes */
+  res |= ufat_fseek(fs, &f, 1, UFAT_SEEK_SET);
+  res |= ufat_fwrite(fs, validate, 1, 1, &f) == 1 ? UFAT_OK : 1;
+  res |= ufat_fseek(fs, &f, i * fs->clusterSize, UFAT_SEEK_SET);
+  res |= ufat_fwrite(fs, validate, 1, 1, &f) == (size_t)UFAT_ERR_COW_LIMIT
+             ? UFAT_OK
+             : 1;
+  res |= ufat_ferror(&f) ? UFAT_OK : 1;
+  res |= ufat_fclose(fs, &f) == UFAT_ERR_COW_LIMIT ? UFAT_OK : 1;
+  if (res || ufat_freecount(fs) != empty ||
+      !readMatches(fs, "cow.bin", test, len)) {
+    TEST_MESSAGE("Update past the copy limit changed the file");
+    return 1;
+  }
+  /* The limit is per stream, a new one starts with an empty list */
+  res = ufat_fopen(fs, "cow.bin", "r+", &f);
+  res |= ufat_fseek(fs, &f, i * fs->clusterSize, UFAT_SEEK_SET);
+  res |= ufat_fwrite(fs, validate, 1, 1, &f) == 1 ? UFAT_OK : 1;
+  res |= ufat_fclose(fs, &f);
+  test[i * fs->clusterSize] = validate[0];
+  if (res || ufat_freecount(fs) != empty ||
+      !readMatches(fs, "cow.bin", test, len)) {
+    TEST_MESSAGE("Update after the copy limit failed");
+    return 1;
+  }
+  TEST_MESSAGE("Copy limit test passed");
+  return 0;
+}
+
+/* Same media as plain, a table entry per 2^clusterShift sectors */
+int clusterTest(ufat_fs_t *fs, ufat_fs_t *plain) {
+  int res;
+  uint32_t empty, used;
+  uint32_t len = 1000;
+  uint32_t shift = fs->clusterShift;
+  ufat_FILE f;
+  takeDownTest = 0;
+  res = ufat_format(plain);
+  res |= ufat_mount(plain);
+  res |= ufat_format(fs);
+  res |= ufat_mount(fs);
+  empty = ufat_freecount(fs);
+  /* The table copies round up to whole clusters, at least the header */
+  if (res || fs->tableBytes << shift != plain->tableBytes ||
+      empty != (plain->sectors >> shift) - fs->firstCluster ||
+      fs->firstCluster <
+          (2 * plain->tableSectors + (1 << shift) - 1) >> shift ||
+      fs->firstCluster * sizeof(ufat_sector_t) <
+          sizeof(ufat_table_header_t)) {
+    TEST_MESSAGE("Cluster table size wrong");
+    return 1;
+  }
+  res = ufat_fopen(fs, "clus.bin", "w", &f);
+  res |= ufat_fwrite(fs, test, 1, len, &f) == len ? UFAT_OK : 1;
+  res |= ufat_fclose(fs, &f);
+  used = empty - ufat_freecount(fs);
+  if (res || used != (len + sizeof(ufat_file_t) + fs->clusterSize - 1) /
+                         fs->clusterSize ||
+      !readMatches(fs, "clus.bin", test, len) || ufat_remove(fs, "clus.bin") ||
+      ufat_freecount(fs) != empty) {
+    TEST_MESSAGE("Cluster allocation wrong");
+    return 1;
+  }
+  TEST_MESSAGE("Cluster test passed");
+  return 0;
+}
+
+/* Writes through a paged table, swaps to a resident table on the same volume
+ * and back, then loses a transaction that evicted pages */
+int pagedTest(ufat_fs_t *fs, ufat_fs_t *resident) {
+  int res;
+  uint32_t i, empty, free;
+  char buf[32];
+  ufat_FILE f;
+  takeDownTest = 0;
+  for (i = 0; i < 0x2000; i++) {
+    test[i] = (uint8_t)getRand();
+  }
+  res = ufat_format(fs);
+  res |= ufat_mount(fs);
+  empty = ufat_freecount(fs);
+  if (res || fs->fat || empty != fs->clusters - fs->firstCluster) {
+    TEST_MESSAGE("Paged format failed");
+    return 1;
+  }
+  /* Chains spread over the volume cross many table sectors */
+  for (i = 0; i < 20 && res == UFAT_OK; i++) {
+    sprintf(buf, "paged%i.bin", i);
+    res = ufat_fopen(fs, buf, "w", &f);
+    res |= ufat_fwrite(fs, &test[i], 1, 0x100 + i * 0x80, &f) ==
+                   0x100 + i * 0x80
+               ? UFAT_OK
+               : 1;
+    res |= ufat_fclose(fs, &f);
+  }
+  res |= ufat_remove(fs, "paged3.bin");
+  free = ufat_freecount(fs);
+  res |= ufat_unmount(fs);
+  res |= ufat_mount(resident);
+  if (res || ufat_freecount(resident) != free ||
+      ufat_exists(resident, "paged3.bin")) {
+    TEST_MESSAGE("Resident mount of a paged volume failed");
+    return 1;
+  }
+  for (i = 0; i < 20; i++) {
+    sprintf(buf, "paged%i.bin", i);
+    if (i != 3 && !readMatches(resident, buf, &test[i], 0x100 + i * 0x80)) {
+      TEST_MESSAGE("Paged write read back wrong");
+      return 1;
+    }
+  }
+  res = ufat_fopen(resident, "resident.bin", "w", &f);
+  res |= ufat_fwrite(resident, validate, 1, 0x400, &f) == 0x400 ? UFAT_OK : 1;
+  res |= ufat_fclose(resident, &f);
+  res |= ufat_remove(resident, "paged5.bin");
+  free = ufat_freecount(resident);
+  res |= ufat_unmount(resident);
+  res |= ufat_mount(fs);
+  if (res || ufat_freecount(fs) != free || ufat_exists(fs, "paged5.bin") ||
+      !readMatches(fs, "resident.bin", validate, 0x400) ||
+      !readMatches(fs, "paged19.bin", &test[19], 0x100 + 19 * 0x80)) {
+    TEST_MESSAGE("Paged mount of a resident volume failed");
+    return 1;
+  }
+  /* Evictions inside the transaction only reach the other copy */
+  res = ufat_begin(fs);
+  for (i = 0; i < 40 && res == UFAT_OK; i++) {
+    sprintf(buf, "txn%i.bin", i);
+    res = ufat_fopen(fs, buf, "w", &f);
+    res |= ufat_fwrite(fs, test, 1, 0x200, &f) == 0x200 ? UFAT_OK : 1;
+    res |= ufat_fclose(fs, &f);
+  }
+  res |= ufat_remove(fs, "resident.bin");
+  res |= ufat_abort(fs);
+  if (res || ufat_freecount(fs) != free || ufat_exists(fs, "txn0.bin") ||
+      !readMatches(fs, "resident.bin", validate, 0x400)) {
+    TEST_MESSAGE("Paged transaction abort failed");
+    return 1;
+  }
+  res = ufat_mount(resident);
+  if (res || ufat_freecount(resident) != free ||
+      ufat_exists(resident, "txn39.bin")) {
+    TEST_MESSAGE("Paged abort left the table changed");
+    return 1;
+  }
+  TEST_MESSAGE("Paged test passed");
+  return 0;
+}
+
+/* Streams a 1.5 MB file through a 32 bit length volume and times it, then
+ * checks a 16 bit length volume stops at 64 KB */
+int largeFileTest(ufat_fs_t *fs, ufat_fs_t *legacy) {
+  int res;
+  uint32_t pos;
+  uint32_t len = 0x180000;
+  uint32_t chunk = 0x1000;
+  char info[256];
+  clock_t start;
+  ufat_FILE f;
+  takeDownTest = 0;
+  for (pos = 0; pos < 2 * chunk; pos++) {
+    test[pos] = (uint8_t)getRand();
+  }
+  res = ufat_format(fs);
+  res |= ufat_mount(fs);
+  /* The last name byte holds the length */
+  if (res || ufat_fopen(fs, "sixteen_chars.ab", "w", &f) != UFAT_ERR_NAME_LEN) {
+    TEST_MESSAGE("Large file volume took a full length name");
+    return 1;
+  }
+  start = clock();
+  res |= ufat_fopen(fs, "image.bin", "w", &f);
+  for (pos = 0; pos < len && res == UFAT_OK; pos += chunk) {
+    /* Each chunk starts further into test */
+    res = ufat_fwrite(fs, &test[(pos / chunk) % chunk], 1, chunk, &f) == chunk
+              ? UFAT_OK
+              : 1;
+  }
+  res |= ufat_fclose(fs, &f);
+  printf("Large file write %u KB in %u ms\r\n", len / 1024,
+         (unsigned)((clock() - start) * 1000 / CLOCKS_PER_SEC));
+  res |= ufat_mount(fs);
+  if (res || ufat_exists(fs, "image.bin") != (int)len) {
+    TEST_MESSAGE("Large file length lost");
+    return 1;
+  }
+  start = clock();
+  res |= ufat_fopen(fs, "image.bin", "r", &f);
+  res |= ufat_flength(&f) == len ? UFAT_OK : 1;
+  for (pos = 0; pos < len && res == UFAT_OK; pos += chunk) {
+    res = ufat_fread(fs, compare, 1, chunk, &f) == chunk &&
+                  memcmp(compare, &test[(pos / chunk) % chunk], chunk) == 0
+              ? UFAT_OK
+              : 1;
+  }
+  res |= ufat_fread(fs, compare, 1, 1, &f) == 0 ? UFAT_OK : 1;
+  printf("Large file read %u KB in %u ms\r\n", len / 1024,
+         (unsigned)((clock() - start) * 1000 / CLOCKS_PER_SEC));
+  res |= ufat_fseek(fs, &f, -0x10, UFAT_SEEK_END);
+  res |= ufat_fread(fs, compare, 1, 0x10, &f) == 0x10 ? UFAT_OK : 1;
+  res |= memcmp(compare, &test[((len - chunk) / chunk) % chunk + chunk - 0x10],
+                0x10)
+             ? 1
+             : UFAT_OK;
+  res |= ufat_fclose(fs, &f);
+  ufat_fsinfo(fs, info, sizeof(info));
+  if (res || !strstr(info, " 1572864 image.bin")) {
+    TEST_MESSAGE("Large file read back failed");
+    return 1;
+  }
+  res |= ufat_fopen(fs, "image.bin", "a", &f);
+  res |= ufat_fwrite(fs, test, 1, 0x100, &f) == 0x100 ? UFAT_OK : 1;
+  res |= ufat_fclose(fs, &f);
+  if (res || ufat_exists(fs, "image.bin") != (int)len + 0x100) {
+    TEST_MESSAGE("Large file append failed");
+    return 1;
+  }
+  /* A 16 bit length takes writes up to 0xFFFF bytes, then refuses */
+  res = ufat_format(legacy);
+  res |= ufat_mount(legacy);
+  res |= ufat_fopen(legacy, "sixteen_chars.ab", "w", &f);
+  for (pos = 0; pos + chunk <= 0xFFFF && res == UFAT_OK; pos += chunk) {
+    res = ufat_fwrite(legacy, test, 1, chunk, &f) == chunk ? UFAT_OK : 1;
+  }
+  res |= ufat_fwrite(legacy, test, 1, chunk, &f) == (size_t)UFAT_ERR_RANGE
+             ? UFAT_OK
+             : 1;
+  res |= ufat_fwrite(legacy, test, 1, 0xFFFF - pos, &f) == 0xFFFF - pos
+             ? UFAT_OK
+             : 1;
+  res |= ufat_fclose(legacy, &f);
+  if (res || ufat_exists(legacy, "sixteen_chars.ab") != 0xFFFF) {
+    TEST_MESSAGE("16 bit length volume did not stop at 64 KB");
+    return 1;
+  }
+  TEST_MESSAGE("Large file test passed");
+  return 0;
+}
+
+#ifdef UFAT_WIDE_TABLE
+/* Fills a volume past sector 0xFFFF, so chains link through wide entries */
+int wideTest(ufat_fs_t *fs) {
+  int res;
+  uint32_t i, files, empty;
+  uint32_t len = 0x1000;
+  char buf[32];
+  ufat_FILE f;
+  takeDownTest = 0;
+  for (i = 0; i < len; i++) {
+    test[i] = (uint8_t)getRand();
+  }
+  res = ufat_format(fs);
+  res |= ufat_mount(fs);
+  empty = ufat_freecount(fs);
+  if (res || fs->sectors <= 0xFFFF) {
+    TEST_MESSAGE("Wide volume did not mount");
+    return 1;
+  }
+  for (files = 0;; files++) {
+    sprintf(buf, "wide%i.bin", files);
+    res = ufat_fopen(fs, buf, "w", &f);
+    if (res || ufat_fwrite(fs, test, 1, len, &f) != len) {
+      ufat_fclose(fs, &f);
+      break;
+    }
+    res = ufat_fclose(fs, &f);
+    if (res) {
+      break;
+    }
+  }
+  /* The failed file freed its chain, too little is left for another */
+  if (ufat_freecount(fs) >= (len + fs->sectorSize) / fs->sectorSize ||
+      ufat_mount(fs) != UFAT_OK) {
+    TEST_MESSAGE("Wide volume did not fill");
+    return 1;
+  }
+  for (i = 0; i < files; i++) {
+    sprintf(buf, "wide%i.bin", i);
+    if (!readMatches(fs, buf, test, len)) {
+      printf("Wide file %i failed\r\n", i);
+      TEST_MESSAGE("Wide read back failed");
+      return 1;
+    }
+  }
+  for (i = 0; i < files; i++) {
+    sprintf(buf, "wide%i.bin", i);
+    res |= ufat_remove(fs, buf);
+  }
+  if (res || ufat_freecount(fs) != empty) {
+    TEST_MESSAGE("Wide remove failed");
+    return 1;
+  }
+  TEST_MESSAGE("Wide test passed");
+  return 0;
+}
+#endif
+
 TEST(POWERSTRESS, TestPowerStress) {
-  TEST_ASSERT_EQUAL(UFAT_OK, PowerStressTest(&fs1));
+  TEST_ASSERT_EQUAL(UFAT_OK, PowerStressTest(&fs1, POWER_CYCLE_COUNT));
   TEST_ASSERT_EQUAL(0, deleteTest(&fs1));
+  TEST_ASSERT_EQUAL(0, dirIndexTest(&fs1));
+  TEST_ASSERT_EQUAL(0, freeCountTest(&fs1));
+  TEST_ASSERT_EQUAL(0, commitSizeTest(&fs1));
+  TEST_ASSERT_EQUAL(0, transactionTest(&fs1));
+  TEST_ASSERT_EQUAL(0, writeBackTest(&fs3));
+  TEST_ASSERT_EQUAL(0, removeErrorTest(&fs3));
+  TEST_ASSERT_EQUAL(0, asyncTest(&fs4));
+  TEST_ASSERT_EQUAL(0, zeroCopyTest(&fs4));
+  TEST_ASSERT_EQUAL(0, zeroCopyTest(&fs1));
+  TEST_ASSERT_EQUAL(0, seekTest(&fs1));
+  TEST_ASSERT_EQUAL(0, appendTest(&fs1));
+  TEST_ASSERT_EQUAL(0, updateTest(&fs1));
+  TEST_ASSERT_EQUAL(0, cowLimitTest(&fs1));
+  TEST_ASSERT_EQUAL(UFAT_OK, PowerStressTest(&fs4, POWER_CYCLE_COUNT / 10));
+  TEST_ASSERT_EQUAL(0, unmountTest(&fs1));
+  TEST_ASSERT_EQUAL(0, mountReadsTest(&fs1));
   TEST_ASSERT_EQUAL(0, fillupTest(&fs1));
   TEST_ASSERT_EQUAL(0, randomWriteLengths(&fs1));
+  TEST_ASSERT_EQUAL(0, nameTableTest(&fs2));
+  TEST_ASSERT_EQUAL(0, fragmentationTest(&fs2));
+  TEST_ASSERT_EQUAL(0, commitSizeTest(&fs2));
+  TEST_ASSERT_EQUAL(0, pingPongTest(&fs2));
+  TEST_ASSERT_EQUAL(0, transactionTest(&fs2));
+  TEST_ASSERT_EQUAL(0, unmountTest(&fs2));
+  TEST_ASSERT_EQUAL(0, mountReadsTest(&fs2));
+  TEST_ASSERT_EQUAL(0, vectoredTest(&fs2));
+  TEST_ASSERT_EQUAL(0, seekTest(&fs2));
+  TEST_ASSERT_EQUAL(0, appendTest(&fs2));
+  TEST_ASSERT_EQUAL(0, updateTest(&fs2));
+  TEST_ASSERT_EQUAL(0, cowLimitTest(&fs2));
+  TEST_ASSERT_EQUAL(UFAT_OK, PowerStressTest(&fs2, POWER_CYCLE_COUNT / 10));
+  TEST_ASSERT_EQUAL(0, randomWriteLengths(&fs2));
+  TEST_ASSERT_EQUAL(0, largeFileTest(&fs6, &fs7));
+  TEST_ASSERT_EQUAL(0, clusterTest(&fs8, &fs1));
+  TEST_ASSERT_EQUAL(0, deleteTest(&fs8));
+  TEST_ASSERT_EQUAL(0, seekTest(&fs8));
+  TEST_ASSERT_EQUAL(0, appendTest(&fs8));
+  TEST_ASSERT_EQUAL(0, updateTest(&fs8));
+  TEST_ASSERT_EQUAL(0, cowLimitTest(&fs8));
+  TEST_ASSERT_EQUAL(UFAT_OK, PowerStressTest(&fs8, POWER_CYCLE_COUNT / 10));
+  TEST_ASSERT_EQUAL(0, fillupTest(&fs8));
+  TEST_ASSERT_EQUAL(0, randomWriteLengths(&fs8));
+  TEST_ASSERT_EQUAL(0, pagedTest(&fs9, &fs10));
+  TEST_ASSERT_EQUAL(0, deleteTest(&fs9));
+  TEST_ASSERT_EQUAL(0, seekTest(&fs9));
+  TEST_ASSERT_EQUAL(0, appendTest(&fs9));
+  TEST_ASSERT_EQUAL(0, updateTest(&fs9));
+  TEST_ASSERT_EQUAL(0, cowLimitTest(&fs9));
+  TEST_ASSERT_EQUAL(UFAT_OK, PowerStressTest(&fs9, POWER_CYCLE_COUNT / 100));
+  TEST_ASSERT_EQUAL(0, fillupTest(&fs9));
+  TEST_ASSERT_EQUAL(0, randomWriteLengths(&fs9));
+#ifdef UFAT_WIDE_TABLE
+  TEST_ASSERT_EQUAL(0, wideTest(&fs5));
+  TEST_ASSERT_EQUAL(UFAT_OK, PowerStressTest(&fs5, POWER_CYCLE_COUNT / 1000));
+#endif
   TEST_PASS();
 }
\ No newline at end of file
@@ -0,0 +1,9 @@
+#include "unity.h"
+#include "unity_fixture.h"
+
+TEST_GROUP_RUNNER(CRC) {
+	RUN_TEST_CASE(CRC, KernelsMatch);
+	RUN_TEST_CASE(CRC, ClmulMatchesTable);
+	RUN_TEST_CASE(CRC, CombineAndPatch);
+	RUN_TEST_CASE(CRC, KernelBenchmark);
+}
\ No newline at end of file
@@ -2,6 +2,7 @@
 
 static void RunAllTests(void) { 
 	RUN_TEST_GROUP(POWERSTRESS); 
+	RUN_TEST_GROUP(CRC);
 }
 
 int main(int argc, const char *argv[]) {